@@ -3,6 +3,7 @@
 #include <DueTimer.h>
 #include <SD.h>
 #include <SPI.h>
+#include <stddef.h>
 #include <stdint.h>
 File SD_write;
 
@@ -11,6 +12,7 @@ File SD_write;
 #include "LT_SPI.h"
 #include "Linduino.h"
 #include "UserInterface.h"
+#include "bms_hardware.h"
 // #include "LT_I2C.h"
 // #include "QuikEval_EEPROM.h"
 
@@ -22,6 +24,242 @@ File SD_write;
 #define DATALOG_DISABLED 0
 /****** Custom ******/
 #define BMS_FAULT_PIN 2
+#define PACK_CURRENT_PIN A0   // Hall sensor output, see CURRENT_SENSOR_*
+#define SPI_LEVELS 3          // Number of entries in SPI_DIV_LADDER
+#define SPI_SWEEP_TRIALS 8    // Clean CFGR + CV reads needed to accept a rate
+#define SPI_PEC_BUDGET 2      // PEC errors per cycle before stepping down
+#define SPI_RECOVER_CYCLES 240  // Clean cycles before stepping back up
+#define READ_RETRIES 3        // Re-reads of a register group that failed PEC
+#define STALE_LIMIT 8         // Cycles an IC may run on stale data
+#define CELLS_PER_IC 12
+#define TEMPS_PER_IC 5        // GPIO1..5 carry the NTCs
+#define BENCH_ROUNDS 1000     // Iterations per side in bench_pack()
+#define CPU_MHZ 84            // Due core clock, the DWT counter rate
+#define SD_CS_PIN 4
+#define LOG_MAGIC 0x4C46      // "FL", first field of every log_frame
+#define LOG_FLUSH_FRAMES 8    // log_frame writes between SD flushes
+#define POLL_TIMEOUT 200000   // LTC681x_pollAdc() count when ADC never ends
+#define CYCLE_DEADLINE_US 300000  // check_stat() + console, idle_wait() aside
+#define CYCLE_IDLE_MS 250  // idle_wait() at the end of every loop() cycle
+#define WDT_TIMEOUT_MS 4000   // Due watchdog, about 7 cycles without a kick
+#define CYCLE_SHED_US 200000  // Into a cycle, past this telemetry is skipped
+#define SHED_RECOVER_CYCLES 8  // Cycles within deadline before it comes back
+#define OVERRUN_FAULT_MISSES 3  // Deadline misses in a row that force FAULT
+#define RESET_MAGIC 0x57440000  // Upper half of the breadcrumbs in GPBR
+// Thresholds below marked (cfg) are only the defaults of bms_config
+#define VMAX_CODE 42000       // 4.2 V, over charged (cfg)
+#define VMIN_CODE 25000       // 2.5 V, over discharged (cfg)
+#define CHARGED_CODE 41200    // 4.12 V, counted as charge finished (cfg)
+#define CHARGE_STOP_CODE 41300  // 4.13 V, bled while charging (cfg)
+#define TEMP_MAX 60           // deg C, over heated (cfg)
+#define TEMP_MIN 0  // deg C, at or below means the NTC is unplugged (cfg)
+#define PWM_STEPS 15          // PWM register value for 100% duty
+#define PWM_UPDATE_CYCLES 8   // Cycles between duty updates, DRIVE/CHARGE
+#define LTC_WATCHDOG_MS 2000  // LTC6811 watchdog, the PWM only runs after it
+#define PWM_WINDOW_MS 5000    // BALANCE_ONLY: chain left to the PWM per plan
+#define DCC_REFRESH_MS 30000  // Unchanged DCC bits rewritten, inside DCTO
+#define CELL_CAPACITY_AH 3.0  // Capacity of one series cell group
+#define BLEED_RESISTOR 33.0   // Ohm, discharge resistor on the slave board
+#define BAL_POWER_LIMIT 2.0   // W, bleed power one slave IC may dissipate
+#define BAL_POWER_STEP 0.1    // W given back per cool reading
+#define DIE_TEMP_CYCLES 8     // Cycles between die temperature reads
+#define DIE_TEMP_LIMIT 80.0   // deg C, slave board ceiling while balancing
+#define DIE_TEMP_HYST 5.0     // deg C below the limit before power returns
+#define NO_FAULT -1
+#define FAULT_RECOVER_CYCLES 20  // Clean cycles before a recoverable fault ends
+#define ST_BIT(x) (1 << (x))
+#define CHARGE_PERIOD_MS 1000  // Charge controller rate
+#define CHARGE_CC_A 10.0       // A, constant current stage (cfg)
+#define CHARGE_CV_CODE 41500   // 4.15 V, highest cell held here in CV (cfg)
+#define CHARGE_END_A 0.5       // A, CV taper current that ends it (cfg)
+#define CHARGE_END_PERIODS 10  // Periods below CHARGE_END_A before done
+// Charge derating by cell temperature, deg C (cfg): nothing at or below
+// CHARGE_T_MIN, half up to CHARGE_T_COLD, full to CHARGE_T_HOT, then down
+// to nothing at CHARGE_T_MAX
+#define CHARGE_T_MIN 0
+#define CHARGE_T_COLD 10
+#define CHARGE_T_HOT 45
+#define CHARGE_T_MAX 55
+#define CHARGE_SLEW_A 2.0      // A per period the request may rise
+#define CHARGE_KP 50.0         // A per V of CV error
+#define CHARGE_KI 5.0          // A per V*s of CV error
+#define CURRENT_SENSOR_OFFSET 1.65  // V at the ADC for 0 A
+#define CURRENT_SENSOR_GAIN 0.0066  // V per A, positive into the pack
+#define DISCHARGE_MAX_A 100.0       // A, discharge limit sent to the ECU
+#define DISCHARGE_TAPER_CODE 33000  // 3.3 V, limit falls below this cell
+// CAN, frames are described in bms_can.dbc (written for TOTAL_IC = 10)
+#define CAN_BAUD CAN_BPS_500K
+#define CAN_LOAD_PCT 30      // Share of the bus telemetry may take
+#define CAN_BURST_BITS 2000  // Unused budget that may be saved up
+#define CAN_TX_MBS 3         // Mailboxes 0..2 transmit
+#define CAN_RX_MB 3          // Mailbox 3 receives the ECU command
+#define CAN_CHARGER_MB 4     // Mailbox 4 receives the charger status
+#define CAN_EXT (1UL << 31)  // Flag in a frame id for a 29-bit identifier
+#define CAN_ID_SUMMARY 0x600
+#define CAN_ID_CELLS 0x601
+#define CAN_ID_TEMPS 0x602
+#define CAN_ID_STATUS 0x603
+#define CAN_ID_LIMITS 0x604
+#define CAN_ID_BALANCE 0x605
+#define CAN_ID_COMMAND 0x610
+#define CAN_CLEAR_MS 1000  // ECU fault clears taken at most this often
+// Elcon/TC style charger, big endian, 0.1 V and 0.1 A per LSB
+#define CAN_ID_CHARGER_REQ (CAN_EXT | 0x1806E5F4)
+#define CAN_ID_CHARGER_STAT (CAN_EXT | 0x18FF50E5)
+#define CHARGER_REQ_MS 250        // Request period, shorter than one cycle
+#define CHARGER_TIMEOUT_MS 2000   // Status silence before the charger is gone
+// Age of the current cycle that still allows charging: a whole cycle, late
+// up to its deadline, plus 100 ms margin. The charger request also goes out
+// from the idle_wait() inside temp_detect(), mid cycle.
+#define BMS_STATE_TIMEOUT_MS (CYCLE_DEADLINE_US / 1000 + CYCLE_IDLE_MS + 100)
+#define CAN_CELLS_PER_PAGE 3
+#define CAN_TEMPS_PER_PAGE 7
+#define CAN_NO_TEMP -128  // int8 sent for an invalid NTC
+#define CONSOLE_RING 128        // Bytes of unparsed serial input kept
+#define CONSOLE_LINE 48         // Longest command line, the rest is cut
+#define CONSOLE_ARGS 6          // Words per command line, command included
+#define CONSOLE_BUDGET_US 2000  // Time console_poll() may spend per loop
+#define BAL_DRIVE 0.3     // V, balancing threshold while driving (cfg)
+#define BAL_CHARGE 0.2    // V, balancing threshold while charging (cfg)
+#define BAL_ONLY 0.01     // V, balancing threshold in BALANCE_ONLY (cfg)
+#define CONFIG_VERSION 2  // Bump whenever bms_config changes
+#define CONFIG_PAGES 2    // Last pages of IFLASH1, written in turn
+#define CAN_CONFIG_MB 5   // Mailbox 5 receives BMS_ConfigSet
+#define CAN_ID_CONFIG 0x611
+
+/**************************** Types ****************************/
+/****** Custom ******/
+enum bms_state {
+  ST_INIT,
+  ST_IDLE,
+  ST_DRIVE,
+  ST_CHARGE,
+  ST_BALANCE,  // balance only, parked car
+  ST_FAULT_RECOVERABLE,
+  ST_FAULT_LATCHED,
+  ST_COUNT,
+};
+
+enum bms_request {  // mode the operator asked for
+  REQ_IDLE,
+  REQ_DRIVE,
+  REQ_CHARGE,
+  REQ_BALANCE,
+};
+
+// Everything the transition guards look at. check_stat() fills it once per
+// cycle, so sm_next() is a pure function of (state, inputs).
+typedef struct {
+  bool measured;         // a full measurement has been taken
+  int8_t fault;          // write_fault() reason raised this cycle
+  bool latching;         // a fault other than stale data was raised
+  uint16_t clean_cycles;  // consecutive cycles without any fault
+  uint8_t request;       // bms_request
+  bool clear_fault;      // operator asked to clear a latched fault
+  bool charge_done;      // charge_detect() saw the pack full
+  bool charger;          // the charger's status frame keeps coming
+} sm_inputs;
+
+typedef struct {
+  uint8_t from;  // ST_BIT() mask of the source states
+  uint8_t to;
+  bool (*guard)(const sm_inputs *in);
+} sm_transition;
+
+typedef struct {
+  const char *name;
+  void (*entry)();
+  void (*exit)();
+  void (*run)();  // once per cycle while in the state
+} sm_state;
+
+typedef struct {
+  uint32_t entries;
+  uint32_t total_ms;
+  uint32_t max_ms;
+} sm_timing;
+
+enum charge_stage {
+  CHG_OFF,
+  CHG_CC,
+  CHG_CV,
+  CHG_DONE,
+};
+
+typedef struct {
+  uint8_t stage;      // charge_stage
+  float current_a;    // measured pack current, positive into the pack
+  float setpoint_a;   // current requested from the charger
+  float voltage_v;    // voltage limit requested from the charger
+  float derate;       // 0..1 from the cell temperatures
+  float integral;     // A, CV regulator state
+  uint8_t end_periods;
+  uint32_t last_ms;
+} charge_ctrl;
+
+// One cyclic frame. A multiplexed frame sends one page per period and walks
+// through its pages, so a full sweep takes pages * period_ms.
+typedef struct {
+  uint32_t id;  // CAN_EXT set for a 29-bit identifier
+  uint16_t period_ms;
+  uint8_t pages;
+  uint8_t dlc;
+  void (*encode)(uint8_t page, uint8_t *data);
+  uint32_t due_ms;
+  uint8_t page;
+} can_msg;
+
+// Last status broadcast by the off-board charger
+typedef struct {
+  float voltage_v;  // output voltage
+  float current_a;  // output current
+  uint8_t flags;    // status byte, 0 when the charger is healthy
+  bool online;      // status seen within CHARGER_TIMEOUT_MS
+  uint32_t seen_ms;
+} charger_link;
+
+typedef struct {
+  const char *name;
+  void (*run)(uint8_t argc, char **argv);  // argv[0] is the command itself
+  const char *help;
+} console_cmd;
+
+// Stages of the loop timed by prof_start()/prof_end()
+enum prof_stage {
+  PS_CHECK,  // all of check_stat()
+  PS_ADC,    // wakeup, ADCV and the conversion
+  PS_RDCV,   // cell registers, re-reads included
+  PS_CALC,
+  PS_PRINT,  // print_cells()
+  PS_AUX,    // ADAX, conversion and aux registers
+  PS_TEMP,   // all of temp_detect(), its idle_wait() included
+  PS_DIE,
+  PS_STATE,  // transition and the run() of the state
+  PS_CONSOLE,
+  PS_COUNT,
+};
+
+typedef struct {
+  uint32_t n;
+  uint32_t min;  // cycles
+  uint32_t max;
+  uint64_t sum;
+} prof_slot;
+
+enum config_type {
+  CFG_U16,
+  CFG_I16,
+  CFG_F32,  // sent over CAN in thousandths
+};
+
+// One tunable of bms_config, by name for the console and by index for CAN
+typedef struct {
+  const char *name;
+  uint8_t type;  // config_type
+  void *field;
+  float lo;
+  float hi;
+} config_param;
 // #define STATE_PIN 3  // In response to the PCB design pinout
 
 /**************** Local Function Declaration *******************/
@@ -36,8 +274,115 @@ void read_voltage();
 void set_all_discharge();
 void stop_all_discharge();
 void balance(double threshold);
+void balance_pwm(double threshold);  // proportional, duty per cell
+void write_pwm();                    // pwm_duty -> PWM register group
+bool pwm_quiet();  // true while BALANCE_ONLY leaves the chain to the PWM
+void write_dcc(const uint16_t *dcc);  // one wrcfg, only if the bits changed
+void dcc_account(uint32_t muted_us);  // integrate delivered discharge time
+void print_duty();                    // delivered discharge since last call
+void die_temp_detect();  // ITMP and THSD, scales bal_power per IC
+void raise_fault(int reason);  // report and feed the state machine
+void voltage_detect();
+uint8_t sm_next(uint8_t state, const sm_inputs *in);  // pure transition
+void sm_step(const sm_inputs *in);  // transition with exit/entry actions
+void print_sm_timing();
+void charge_control();  // CC/CV regulator, runs every CHARGE_PERIOD_MS
+void charge_reset();
+float read_pack_current();
+float charge_derate();  // 0..1 from the hottest/coldest valid NTC
+void enter_charge();
+void exit_charge();
+bool temp_extremes(int16_t *hot, int16_t *cold);  // false: no valid NTC
+float discharge_limit();  // A, tapered by the lowest cell and the hottest NTC
+void can_setup();
+void can_service();  // receive, then fill the free mailboxes within budget
+bool can_write(uint8_t mb, uint32_t id, const uint8_t *data, uint8_t dlc);
+void can_receive();
+void can_command(const uint8_t *data);  // BMS_Command from the ECU
+uint16_t can_frame_bits(uint8_t dlc, bool ext);  // worst case, with stuffing
+void idle_wait(uint32_t ms);  // delay() that keeps the CAN scheduler running
+void put_u16(uint8_t *data, uint16_t value);  // little endian
+void can_summary(uint8_t page, uint8_t *data);
+void can_cells(uint8_t page, uint8_t *data);
+void can_temps(uint8_t page, uint8_t *data);
+void can_status(uint8_t page, uint8_t *data);
+void can_limits(uint8_t page, uint8_t *data);
+void can_balance(uint8_t page, uint8_t *data);
+void can_charger_req(uint8_t page, uint8_t *data);
+void charger_status(const uint8_t *data);  // decode the charger broadcast
+void charger_watch();  // follow the charger coming and going, each cycle
+bool charger_may_run();  // heartbeat watchdog for the charger request
+void put_u16_be(uint8_t *data, uint16_t value);
+void console_poll();  // ring in the serial input, run the complete lines
+void console_exec(char *line);
+bool console_num(const char *arg, long lo, long hi, long *value);
+void cmd_help(uint8_t argc, char **argv);
+void cmd_clear(uint8_t argc, char **argv);
+void cmd_fault(uint8_t argc, char **argv);
+void cmd_mode(uint8_t argc, char **argv);
+void cmd_discharge(uint8_t argc, char **argv);
+void cmd_balance(uint8_t argc, char **argv);
+void cmd_set(uint8_t argc, char **argv);
+void cmd_bypass(uint8_t argc, char **argv);
+void cmd_dump(uint8_t argc, char **argv);
+void cmd_vmin(uint8_t argc, char **argv);
+void cmd_bench(uint8_t argc, char **argv);
+void cmd_config(uint8_t argc, char **argv);
+void cmd_prof(uint8_t argc, char **argv);
+void cmd_log(uint8_t argc, char **argv);
+// Measurement log. A log_frame holds what one check_stat() cycle measured
+// after PEC recovery, plus the requests it saw, so the host build can run
+// the same fault, balancing and state machine code on recorded data.
+bool sd_ready();
+void log_write();  // appends this cycle when logging
+// Loop profiler, cycle counts from the DWT, from micros() in the host build
+void prof_init();
+uint32_t prof_now();
+uint32_t prof_start();
+void prof_end(uint8_t stage, uint32_t start);  // also checks WCET_BUDGET_US
+void prof_reset();
+void prof_report();
+// Execution time budgets. Every prof stage has one, the cycle has a deadline
+// and the watchdog is only kicked when the cycle made it.
+void cmd_wcet(uint8_t argc, char **argv);
+void wcet_cycle();  // end of a loop() cycle, before idle_wait
+void wcet_report();
+bool wcet_shed();  // skip what the pack is safe without, the cycle is late
+bool verbose_cycle();  // the periodic prints, every 4th cycle unless shed
+void wdt_kick();
+void reset_report();  // why the last reset, from RSTC and the breadcrumb
+void fault_crumb(int8_t fault);  // latched fault for after a watchdog reset
+void config_defaults();
+void config_load();  // newest valid flash page, defaults if there is none
+bool config_save();  // write the older page and verify it
+bool config_check(const void *block);  // version, length and CRC
+uint8_t *config_page(uint8_t page);    // address of one of the CONFIG_PAGES
+bool config_set(uint8_t index, float value);  // range checked, then applied
+const char *config_conflict(const void *block);  // broken ordering or NULL
+void config_apply();  // push the fields that live in the LTC6811 CFGR
+void config_print();
+void can_config(const uint8_t *data);  // BMS_ConfigSet from CAN
+uint32_t crc32(const uint8_t *data, uint32_t length);
+void balance_loop();
+void enter_safe();  // fault pin LOW, stop discharge
+void enter_ok();    // fault pin HIGH
+void run_fault();
+void run_none();
+bool g_fault_latch(const sm_inputs *in);
+bool g_fault_recover(const sm_inputs *in);
+bool g_recovered(const sm_inputs *in);
+bool g_cleared(const sm_inputs *in);
+bool g_measured(const sm_inputs *in);
+bool g_want_drive(const sm_inputs *in);
+bool g_want_charge(const sm_inputs *in);
+bool g_want_balance(const sm_inputs *in);
+bool g_leave_drive(const sm_inputs *in);
+bool g_leave_charge(const sm_inputs *in);
+bool g_leave_balance(const sm_inputs *in);
+bool plan_balance(double threshold);  // pwm_duty and bal_eta_h from excess Ah
+float soc_from_code(uint16_t code);   // 0..1 from the OCV table
 void check_stat();
-void calculate();
+void calculate();  // fused statistics pass over the pack snapshot
 void reset_vmin();
 void set_ic_discharge(   // Add to balance function formally when compeleted
     int Cell,            // The cell to be discharged
@@ -52,8 +397,17 @@ void stop_ic_discharge(
 void temp_detect();            // called by calculate
 void error_temp();             // detect temperature rules violation
 void write_fault(int reason);  // voltage out of range: 0, over heat: 1,
-                               // temp unpluged: 2, charge finish: 3, other: 4
+                               // temp unpluged: 2, charge finish: 3, other: 4,
+                               // stale data: 5, loop over deadline: 6
 void charge_detect();
+void spi_sweep();         // pick the fastest clean SPI rate at startup
+void spi_link_monitor();  // step the SPI rate down/up from PEC counters
+uint32_t pec_total();     // sum of crc_count.pec_count over the chain
+int8_t read_cells_checked();  // rdcv + re-read of the groups failing PEC
+int8_t read_aux_checked();    // rdaux + re-read of the groups failing PEC
+int8_t recover_groups(uint8_t type);  // type: CELL or AUX
+void stale_detect();
+void bench_pack();  // time the cell_asic scan against calculate()
 /****** Test ******/
 void select(int ic, int cell);
 
@@ -67,7 +421,7 @@ const uint8_t TOTAL_IC = 10;  //!< Number of ICs in the daisy chain
 // ADC Command Configurations. See LTC681x.h for options.
 const uint8_t ADC_OPT = ADC_OPT_DISABLED;
 const uint8_t ADC_CONVERSION_MODE = MD_7KHZ_3KHZ;
-const uint8_t ADC_DCP = DCP_ENABLED;
+const uint8_t ADC_DCP = DCP_DISABLED;  // S pins pause only while converting
 const uint8_t CELL_CH_TO_CONVERT = CELL_CH_ALL;
 const uint8_t AUX_CH_TO_CONVERT = AUX_CH_ALL;
 const uint8_t STAT_CH_TO_CONVERT = STAT_CH_ALL;
@@ -87,26 +441,302 @@ const uint8_t MEASURE_CELL = ENABLED;
 const uint8_t MEASURE_AUX = DISABLED;
 const uint8_t MEASURE_STAT = DISABLED;
 const uint8_t PRINT_PEC = DISABLED;
+const uint8_t BALANCE_PWM = ENABLED;  // balance_pwm() instead of balance()
+const uint8_t WATCHDOG = ENABLED;       // kicked by cycles within deadline
+const uint8_t PROFILE_LOOP = ENABLED;   // time the loop stages, see `prof`
 
 cell_asic BMS_IC[TOTAL_IC];  //!< Global Battery Variable
 
 /****************** Custom ******************/
-double vmin[TOTAL_IC];
-double vmax[TOTAL_IC];
+// Everything that used to need a re-flash to change. config_load() fills cfg
+// once at boot, afterwards the checks read the fields directly and only
+// config_save() touches the flash.
+typedef struct {
+  uint16_t version;   // CONFIG_VERSION
+  uint16_t length;    // sizeof(bms_config)
+  uint32_t sequence;  // the valid page with the higher one is current
+  uint16_t vmax_code;
+  uint16_t vmin_code;
+  uint16_t charged_code;
+  uint16_t charge_stop_code;
+  uint16_t charge_cv_code;
+  uint16_t ov_code;  // LTC6811 comparators
+  uint16_t uv_code;
+  int16_t temp_max;
+  int16_t temp_min;
+  float bal_drive;
+  float bal_charge;
+  float bal_only;
+  float charge_cc_a;
+  float charge_end_a;
+  int16_t charge_t_min;  // charge derating break points
+  int16_t charge_t_cold;
+  int16_t charge_t_hot;
+  int16_t charge_t_max;
+  // One bit per cell/NTC, bit i is cell i+1 or GPIO i+1
+  uint16_t volt_bypass[TOTAL_IC];
+  uint16_t temp_bypass[TOTAL_IC];
+  uint32_t crc;  // CRC-32 of everything above
+} bms_config;
+static_assert(sizeof(bms_config) <= IFLASH1_PAGE_SIZE, "config over a page");
+// The library keeps SPI lengths in a uint8_t, WRCFG has 4 more bytes
+static_assert(4 + TOTAL_IC * NUM_RX_BYT <= 255, "chain too long for LTC681x");
+
+bms_config cfg;
+uint8_t cfg_page = 0;  // page cfg came from, the other one is written next
+const config_param CONFIG_PARAMS[] = {
+    {"vmax", CFG_U16, &cfg.vmax_code, 30000, 45000},
+    {"vmin", CFG_U16, &cfg.vmin_code, 20000, 35000},
+    {"charged", CFG_U16, &cfg.charged_code, 35000, 42000},
+    {"charge_stop", CFG_U16, &cfg.charge_stop_code, 35000, 42000},
+    {"cv", CFG_U16, &cfg.charge_cv_code, 35000, 42000},
+    {"ov", CFG_U16, &cfg.ov_code, 0, 65535},
+    {"uv", CFG_U16, &cfg.uv_code, 0, 65535},
+    {"temp_max", CFG_I16, &cfg.temp_max, 20, 80},
+    {"temp_min", CFG_I16, &cfg.temp_min, -40, 20},
+    {"bal_drive", CFG_F32, &cfg.bal_drive, 0, 1},
+    {"bal_charge", CFG_F32, &cfg.bal_charge, 0, 1},
+    {"bal_only", CFG_F32, &cfg.bal_only, 0, 1},
+    {"charge_a", CFG_F32, &cfg.charge_cc_a, 0, 50},
+    {"end_a", CFG_F32, &cfg.charge_end_a, 0, 10},
+    {"chg_tmin", CFG_I16, &cfg.charge_t_min, -20, 20},
+    {"chg_tcold", CFG_I16, &cfg.charge_t_cold, -20, 30},
+    {"chg_thot", CFG_I16, &cfg.charge_t_hot, 20, 60},
+    {"chg_tmax", CFG_I16, &cfg.charge_t_max, 20, 70},
+};
+
 double consvmin[TOTAL_IC];
-enum stats {
-  FAULT,
-  WORK,
-  CHARGE,
+uint16_t charge_finish[TOTAL_IC] = {0};
+uint16_t temp_high[TOTAL_IC] = {0};  // above cfg.temp_max
+uint16_t temp_low[TOTAL_IC] = {0};   // at or below cfg.temp_min
+uint8_t pwm_duty[TOTAL_IC][CELLS_PER_IC] = {0};  // 0..PWM_STEPS
+float bal_eta_h = 0;  // predicted hours until the pack is balanced
+
+// DCC bits the balancer wants and the bits last written to the chain. The
+// cells are measured with DCP_DISABLED, so the LTC6811 itself pauses the S
+// pins for the conversion and resumes them from CFGR afterwards. Balancing
+// therefore never has to be torn down and rebuilt around a measurement.
+uint16_t dcc_cache[TOTAL_IC] = {0};
+uint16_t dcc_live[TOTAL_IC] = {0};
+uint32_t dcc_stamp = 0;     // micros() of the last dcc_account()
+uint64_t dcc_on_us = 0;     // cell-microseconds of delivered discharge
+uint32_t dcc_wall_us = 0;   // time covered by dcc_on_us
+uint32_t dcc_written_ms = 0;  // millis() of the last wrcfg of the DCC bits
+bool pwm_window = false;      // the chain is left alone, PWMR drives S pins
+uint32_t pwm_window_ms = 0;   // millis() when the window started
+uint32_t pwm_window_us = 0;   // micros() of the same, for dcc_account()
+uint32_t dcc_writes = 0;    // wrcfg issued by write_dcc()
+
+// Bleed power each IC may use, lowered by die_temp_detect() when the die
+// gets hot (halved per hot reading) and given back in BAL_POWER_STEP steps.
+float bal_power[TOTAL_IC];
+float die_temp[TOTAL_IC] = {0};
+
+// BMS state machine. Transitions are checked in table order and the first
+// guard that passes wins, at most one transition per cycle.
+#define RUNNING_STATES                                                   \
+  (ST_BIT(ST_INIT) | ST_BIT(ST_IDLE) | ST_BIT(ST_DRIVE) | ST_BIT(ST_CHARGE) | \
+   ST_BIT(ST_BALANCE))
+const sm_transition SM_TABLE[] = {
+    {RUNNING_STATES | ST_BIT(ST_FAULT_RECOVERABLE), ST_FAULT_LATCHED,
+     g_fault_latch},
+    {RUNNING_STATES, ST_FAULT_RECOVERABLE, g_fault_recover},
+    {ST_BIT(ST_FAULT_RECOVERABLE), ST_IDLE, g_recovered},
+    {ST_BIT(ST_FAULT_LATCHED), ST_IDLE, g_cleared},
+    {ST_BIT(ST_INIT), ST_IDLE, g_measured},
+    {ST_BIT(ST_IDLE), ST_DRIVE, g_want_drive},
+    {ST_BIT(ST_IDLE), ST_CHARGE, g_want_charge},
+    {ST_BIT(ST_IDLE), ST_BALANCE, g_want_balance},
+    {ST_BIT(ST_DRIVE), ST_IDLE, g_leave_drive},
+    {ST_BIT(ST_CHARGE), ST_IDLE, g_leave_charge},
+    {ST_BIT(ST_BALANCE), ST_IDLE, g_leave_balance},
+};
+const sm_state SM_STATES[ST_COUNT] = {
+    {"INIT", enter_safe, run_none, run_none},
+    {"IDLE", enter_ok, run_none, run_none},
+    {"DRIVE", enter_ok, stop_all_discharge, work_loop},
+    {"CHARGE", enter_charge, exit_charge, charge_loop},
+    {"BALANCE_ONLY", enter_ok, stop_all_discharge, balance_loop},
+    {"FAULT_RECOVERABLE", enter_safe, run_none, run_fault},
+    {"FAULT_LATCHED", enter_safe, run_none, run_fault},
+};
+uint8_t state = ST_INIT;
+sm_inputs bms_in = {false, NO_FAULT, false, 0, REQ_DRIVE, false, false, false};
+sm_timing sm_time[ST_COUNT] = {0};
+uint32_t sm_since = 0;     // millis() when the current state was entered
+bool manual_fault = false;  // console '5', held until cleared with '0'
+uint32_t can_clear_ms = 0;  // millis() of the last ClearFault taken
+charge_ctrl charger = {CHG_OFF, 0, 0, 0, 1, 0, 0, 0};
+
+can_msg CAN_SCHEDULE[] = {
+    {CAN_ID_SUMMARY, 100, 1, 8, can_summary, 0, 0},
+    {CAN_ID_CELLS, 25, (TOTAL_IC * CELLS_PER_IC + 2) / CAN_CELLS_PER_PAGE, 8,
+     can_cells, 0, 0},
+    {CAN_ID_TEMPS, 125, (TOTAL_IC * TEMPS_PER_IC + 6) / CAN_TEMPS_PER_PAGE, 8,
+     can_temps, 0, 0},
+    {CAN_ID_STATUS, 100, 1, 8, can_status, 0, 0},
+    {CAN_ID_LIMITS, 100, 1, 8, can_limits, 0, 0},
+    {CAN_ID_BALANCE, 1000, 1, 2, can_balance, 0, 0},
+    {CAN_ID_CHARGER_REQ, CHARGER_REQ_MS, 1, 8, can_charger_req, 0, 0},
+};
+bool can_ok = false;
+uint32_t can_budget = 0;     // bits the scheduler may still put on the bus
+uint32_t can_refill_ms = 0;  // millis() of the last budget refill
+uint32_t can_sent = 0;
+uint32_t can_late = 0;  // frames that missed a whole period and were skipped
+uint8_t can_alive = 0;  // rolling counter in the status frame
+charger_link obc = {0, 0, 0, false, 0};
+uint32_t bms_cycle_ms = 0;  // millis() when check_stat() last started
+
+// Serial console. Bytes are moved from the UART into con_ring as they come,
+// and only whole lines are parsed, so nothing in loop() waits for input.
+const console_cmd CONSOLE_CMDS[] = {
+    {"help", cmd_help, ""},
+    {"clear", cmd_clear, "clear the fault"},
+    {"fault", cmd_fault, "raise a manual fault"},
+    {"mode", cmd_mode, "idle|drive|charge|balance"},
+    {"discharge", cmd_discharge, "all|off"},
+    {"balance", cmd_balance, "<ic 0-9> <cell 1-12> on|off"},
+    {"set", cmd_set, "<name> <value>, until config save"},
+    {"config", cmd_config, "show|save|defaults"},
+    {"bypass", cmd_bypass, "volt|temp <ic 0-9> <bit> [off]"},
+    {"dump", cmd_dump, "stats|cells|temps|timing|duty|can|charger"},
+    {"vmin", cmd_vmin, "reset the constant vmin"},
+    {"bench", cmd_bench, "time the pack scan"},
+    {"prof", cmd_prof, "[reset], time per loop stage"},
+    {"log", cmd_log, "start <file>|stop, record cycles to SD"},
+    {"wcet", cmd_wcet, "[reset], budgets and worst times"},
 };
-stats status;
-uint32_t temp[TOTAL_IC][12];
-uint16_t volt_bypass[TOTAL_IC][12] = {0};
-uint16_t temp_bypass[TOTAL_IC][12] = {0};
-uint16_t charge_finish[TOTAL_IC][12] = {0};
+char con_ring[CONSOLE_RING];
+uint8_t con_head = 0;   // next byte written
+uint8_t con_tail = 0;   // next byte parsed
+uint8_t con_lines = 0;  // complete lines waiting in con_ring
+bool con_discard = false;  // dropping the rest of a too long line
+
+// One check_stat() cycle as recorded on the SD card, little endian
+typedef struct {
+  uint16_t magic;  // LOG_MAGIC
+  uint8_t total_ic;
+  uint8_t request;  // bms_in.request
+  uint32_t ms;      // millis() at the end of the cycle
+  uint16_t cells[TOTAL_IC][CELLS_PER_IC];  // after recover_groups()
+  uint16_t aux[TOTAL_IC][6];
+  uint16_t itmp[TOTAL_IC];  // last ITMP read
+  uint16_t cell_stale[TOTAL_IC];
+  uint8_t aux_stale[TOTAL_IC];
+  int16_t current_da;  // 0.1A into the pack
+  uint8_t flags;       // bit 0: manual fault
+  uint8_t reserved[3];  // keeps crc aligned without padding
+  uint32_t crc;  // crc32 of everything above
+} log_frame;
+
+File log_file;
+bool logging = false;
+uint16_t log_pending = 0;  // frames written since the last flush
+
+prof_slot prof[PS_COUNT];
+// Worst case allowed per stage in us, on the real chain at 115200 baud
+const uint32_t WCET_BUDGET_US[PS_COUNT] = {
+    280000,  // check_stat, print and temp_detect included
+    15000,   // adc, wakeup of 10 ICs and a 7 kHz conversion
+    20000,   // rdcv, with every retry
+    5000,    // calculate
+    150000,  // print, ~1.2 kB at 115200 baud
+    15000,   // aux
+    130000,  // temp_detect, its idle_wait(100) included
+    15000,   // die_temp
+    20000,   // state
+    20000,   // console, CONSOLE_BUDGET_US and the command run
+};
+uint32_t wcet_overruns[PS_COUNT] = {0};
+uint32_t wcet_worst[PS_COUNT] = {0};  // us
+uint32_t wcet_cycles = 0;
+uint32_t wcet_missed = 0;       // cycles past CYCLE_DEADLINE_US
+uint32_t wcet_cycle_worst = 0;  // us
+// Staged response to a late loop: telemetry and logging are shed first,
+// OVERRUN_FAULT_MISSES misses in a row force FAULT, and the watchdog resets
+// the board if the cycles still don't make it.
+uint32_t wcet_start = 0;    // prof_now() at the start of the cycle
+bool wcet_shedding = false;
+uint16_t wcet_in_row = 0;        // consecutive missed deadlines
+uint16_t wcet_clean = 0;         // cycles within deadline while shedding
+uint8_t reset_cause = 0xFF;      // RSTC_SR RSTTYP, 0xFF where there's no RSTC
+uint8_t reset_stage = PS_COUNT;  // last stage finished before it
+int8_t reset_fault = NO_FAULT;   // still latched when the watchdog hit
+const char *const RESET_NAMES[5] = {"power on", "backup", "watchdog",
+                                    "software", "NRST pin"};
+const char *const PROF_NAMES[PS_COUNT] = {
+    "check_stat", "adc", "rdcv", "calculate", "print", "aux", "temp_detect",
+    "die_temp", "state", "console",
+};
+
+
+// Rest voltage at 0%, 10%, ..., 100% state of charge
+const uint16_t OCV_TABLE[11] = {30000, 34500, 35500, 36200, 36800, 37400,
+                                38200, 39100, 39900, 40800, 42000};
 bool SD_READY;
 int count;
 
+// SPI clock ladder, fastest first. The LTC6811/LTC6820 SPI port is rated
+// for 1MHz, so SPI_CLOCK_DIV16 is the ceiling and the ladder only goes down.
+const uint8_t SPI_DIV_LADDER[SPI_LEVELS] = {SPI_CLOCK_DIV16, SPI_CLOCK_DIV32,
+                                            SPI_CLOCK_DIV64};
+uint8_t spi_ceiling = 0;  // fastest level that passed the startup sweep
+uint8_t spi_level = 0;    // level currently in use
+uint32_t spi_last_pec = 0;
+uint16_t spi_clean_cycles = 0;
+
+// Last codes that passed PEC. A group that still fails after READ_RETRIES
+// is restored from here and its channels are flagged in cell_stale/aux_stale.
+uint16_t good_cells[TOTAL_IC][12] = {0};
+uint16_t good_aux[TOTAL_IC][6] = {0};
+uint16_t cell_stale[TOTAL_IC] = {0};  // bit i: cell i is stale
+uint8_t aux_stale[TOTAL_IC] = {0};    // bit i: aux channel i is stale
+uint8_t stale_cycles[TOTAL_IC] = {0};
+// bit g: register group g+1 passed PEC at least once since boot. Until it
+// has, there's nothing to restore and its channels count as not read.
+uint8_t cell_groups_read[TOTAL_IC] = {0};
+uint8_t aux_groups_read[TOTAL_IC] = {0};
+
+// Struct-of-arrays copy of the measurements, written by recover_groups() and
+// temp_detect() as they parse, so the aggregate scans walk contiguous memory
+// instead of striding through the ~200 byte cell_asic records.
+typedef struct {
+  uint16_t voltage[TOTAL_IC * CELLS_PER_IC];  // cell codes, 100uV per LSB
+  int16_t temp[TOTAL_IC * TEMPS_PER_IC];      // deg C
+  uint16_t volt_valid[TOTAL_IC];  // bit i: cell i is read and not bypassed
+  uint8_t temp_valid[TOTAL_IC];   // bit i: NTC i is read and not bypassed
+} pack_data;
+
+typedef struct {
+  uint16_t min;  // lowest valid cell code
+  uint16_t max;  // highest valid cell code
+  uint8_t min_cell;
+  uint8_t max_cell;
+  uint32_t sum;
+  uint8_t n;  // number of valid cells
+} ic_stats;
+
+// Written once per cycle by calculate(), read by the fault checks, balance(),
+// charge_detect() and print_cells() instead of rescanning the cells.
+typedef struct {
+  ic_stats ic[TOTAL_IC];
+  uint16_t min;
+  uint16_t max;
+  uint8_t min_ic;
+  uint8_t min_cell;
+  uint8_t max_ic;
+  uint8_t max_cell;
+  uint32_t sum;  // 100uV per LSB
+  uint16_t n;
+  float mean;       // V
+  float stdev;      // V
+  uint16_t n_charged;  // cells at or above cfg.charged_code
+} pack_stats;
+
+pack_data pack;
+pack_stats stats;
+
 /*********************************************************
  Set the configuration bits.
  Refer to the Configuration Register Group from data sheet.
@@ -118,14 +748,31 @@ uint16_t UV = UV_THRESHOLD;  //!< Under-voltage Comparison Voltage
 uint16_t OV = OV_THRESHOLD;  //!< Over-voltage Comparison Voltage
 bool DCCBITS_A[12] = {false, false, false, false, false, false,
                       false, false, false, false, false, false};
-bool DCTOBITS[4] = {true, false, true, false};
+// DCTO = 2: the discharge timer clears DCC 1 min after the last wrcfg, so
+// a hung BMS stops bleeding, and it keeps DCC and the PWM running once the
+// LTC6811 watchdog has expired in a PWM window
+bool DCTOBITS[4] = {false, true, false, false};
+
+// Called by the Due core before setup(). WDT_MR can be written only once
+// after reset, so the watchdog is set up here or never.
+void watchdogSetup() {
+  if (WATCHDOG) {
+    watchdogEnable(WDT_TIMEOUT_MS);
+  } else {
+    watchdogDisable();
+  }
+}
 
 void setup() {
   // **************** Stock setup ****************
   Serial.begin(115200);
+  reset_report();
+  prof_init();
+  config_load();
+  UV = cfg.uv_code;
+  OV = cfg.ov_code;
   quikeval_SPI_connect();
-  spi_enable(
-      SPI_CLOCK_DIV16);  // This will set the Linduino to have a 1MHz Clock
+  spi_enable(SPI_DIV_LADDER[0]);  // 1MHz until spi_sweep() picks the rate
   LTC6811_init_cfg(TOTAL_IC, BMS_IC);
   for (uint8_t current_ic = 0; current_ic < TOTAL_IC; current_ic++) {
     LTC6811_set_cfgr(current_ic, BMS_IC, REFON, ADCOPT, GPIOBITS_A, DCCBITS_A,
@@ -133,6 +780,10 @@ void setup() {
   }
   LTC6811_reset_crc_count(TOTAL_IC, BMS_IC);
   LTC6811_init_reg_limits(TOTAL_IC, BMS_IC);
+  spi_sweep();
+  for (int i = 0; i < TOTAL_IC; i++) {
+    bal_power[i] = BAL_POWER_LIMIT;
+  }
 
   // **************** SD card setup ****************
   // SD_READY = SD.begin(4);
@@ -172,60 +823,38 @@ void setup() {
   Serial.print("\n");
 
   pinMode(BMS_FAULT_PIN, OUTPUT);
+  analogReadResolution(12);
+  can_setup();
 
   // pinMode(STATE_PIN, INPUT);
-  // (digitalRead(STATE_PIN) == HIGH) ? status = CHARGE : status = WORK;
-  status = WORK;
+  // bms_in.request = (digitalRead(STATE_PIN) == HIGH) ? REQ_CHARGE : REQ_DRIVE;
+  bms_in.request = REQ_DRIVE;  // INIT -> IDLE -> DRIVE once measured
+  // A watchdog reset doesn't clear a latched fault, only the operator does
+  state = reset_fault == NO_FAULT ? ST_INIT : ST_FAULT_LATCHED;
+  SM_STATES[state].entry();
+  sm_time[state].entries++;
+  sm_since = millis();
   count = 0;
 
+  wdt_kick();
   Serial.println(F("Setup completed"));
-
-  // ******** By pass list *********
-  // volt_bypass[9][11] = 1;
-  temp_bypass[7][4] = 1;
 }
 
 void loop() {
-  check_stat();
+  wcet_start = prof_start();
+  if (!pwm_quiet()) {
+    check_stat();
+  }
   // read_voltage();  // read and print the current voltage
   // calculate();     // calculate minimal and maxium
   // temp_detect();
 
-  // *********************** testing area **************************
-  if (Serial.available() > 0) {
-    switch (Serial.read()) {
-      case '1':
-        Serial.print("******* dicharge all *******\n");
-        set_all_discharge();
-        break;
-      case '2':
-        Serial.print("****** stop discharge ******\n");
-        stop_all_discharge();
-        break;
-      case '3':
-        status = WORK;
-        break;
-      case '4':
-        status = CHARGE;
-        break;
-      case '5':
-        status = FAULT;
-        break;
-      case '6':
-        Serial.print("********* reset vmin *******\n");
-        reset_vmin();
-        break;
-      case '7':
-        Serial.print("********** select **********\n");
-        select(1, 8);
-        break;
-      default:
-        Serial.print("******** do nothing ********\n");
-        break;
-    }
-  }
+  uint32_t t = prof_start();
+  console_poll();  // commands, see CONSOLE_CMDS
+  prof_end(PS_CONSOLE, t);
+  wcet_cycle();  // kicks the watchdog if the deadline was met
 
-  delay(250);
+  idle_wait(CYCLE_IDLE_MS);
   count++;
 }
 
@@ -250,17 +879,34 @@ void print_cells(uint8_t datalog_en) {  // modified
           Serial.print(float(0), 4);
         } else {
           Serial.print(BMS_IC[current_ic].cells.c_codes[i] * 0.0001, 4);
-          total += BMS_IC[current_ic].cells.c_codes[i] * 0.0001;
         }
         Serial.print(", ");
       }
       Serial.println();
     }
   }
+  total = stats.sum * 0.0001;
   Serial.print("\n");
   Serial.print("Total: ");
   Serial.print(total, 4);
   Serial.println(" V");
+  Serial.print("Min: ");
+  Serial.print(stats.min * 0.0001, 4);
+  Serial.print(" V [");
+  Serial.print(stats.min_ic + 1, DEC);
+  Serial.print("][");
+  Serial.print(stats.min_cell);
+  Serial.print("]  Max: ");
+  Serial.print(stats.max * 0.0001, 4);
+  Serial.print(" V [");
+  Serial.print(stats.max_ic + 1, DEC);
+  Serial.print("][");
+  Serial.print(stats.max_cell);
+  Serial.print("]  Mean: ");
+  Serial.print(stats.mean, 4);
+  Serial.print(" V  Stdev: ");
+  Serial.print(stats.stdev * 1000, 1);
+  Serial.println(" mV");
 }
 
 /****** Custom ******/
@@ -271,43 +917,65 @@ void Isr() {  // Interrupt main
 
 void work_loop() {  // thresholds are yet to be determined
   reset_vmin();
-  balance(0.3);  // Arg = I*R when working
+  BALANCE_PWM ? balance_pwm(cfg.bal_drive) : balance(cfg.bal_drive);  // I*R
 }
 
 void charge_loop() {  // thresholds are yet to be determined
   reset_vmin();
-  balance(0.2);     // Arg = 0.1, or charging I*R
-  charge_detect();  // check whether charging is done
+  BALANCE_PWM ? balance_pwm(cfg.bal_charge) : balance(cfg.bal_charge);
+  charge_detect();  // bleed the cells that run ahead
+  if (millis() - charger.last_ms >= CHARGE_PERIOD_MS) {
+    charge_control();
+  }
+}
+
+void balance_loop() {  // parked, no load, so balance down to a tight band
+  reset_vmin();
+  BALANCE_PWM ? balance_pwm(cfg.bal_only) : balance(cfg.bal_only);
 }
 
 void read_voltage() {
   int8_t error = 0;
   uint32_t conv_time = 0;
 
+  uint32_t t = prof_start();
   wakeup_sleep(TOTAL_IC);
+  uint32_t start = micros();
   LTC6811_adcv(ADC_CONVERSION_MODE, ADC_DCP, CELL_CH_TO_CONVERT);
   conv_time = LTC6811_pollAdc();
+  dcc_account(micros() - start);  // S pins were off for the conversion
   wakeup_idle(TOTAL_IC);
-  error = LTC6811_rdcv(SEL_ALL_REG, TOTAL_IC,
-                       BMS_IC);  // Set to read back all cell voltage registers
+  prof_end(PS_ADC, t);
+  t = prof_start();
+  error = read_cells_checked();  // read back all cell voltage registers
+  if (conv_time >= POLL_TIMEOUT) {  // the registers hold an old conversion
+    for (int current_ic = 0; current_ic < TOTAL_IC; current_ic++) {
+      cell_stale[current_ic] = (1 << CELLS_PER_IC) - 1;
+    }
+    error = -1;
+  }
   check_error(error);
+  prof_end(PS_RDCV, t);
+  t = prof_start();
+  calculate();  // statistics right after parsing, before anything prints
+  prof_end(PS_CALC, t);
 
   // eliminate failed observation
-  if (conv_time != 0 && (count % 4 == 0)) {
+  if (conv_time != 0 && verbose_cycle()) {
+    t = prof_start();
     print_cells(DATALOG_DISABLED);
+    prof_end(PS_PRINT, t);
   }
 }
 
 void set_all_discharge() {
   int8_t error = 0;
-  uint32_t conv_time = 0;
 
   wakeup_sleep(TOTAL_IC);
-  for (int i = 0; i < BMS_IC[0].ic_reg.cell_channels; i++) {
-    wakeup_sleep(TOTAL_IC);
-    LTC6811_set_discharge(i + 1, TOTAL_IC, BMS_IC);
-    LTC6811_wrcfg(TOTAL_IC, BMS_IC);
+  for (int i = 0; i < TOTAL_IC; i++) {
+    dcc_cache[i] = 0x0FFF;
   }
+  write_dcc(dcc_cache);
   wakeup_idle(TOTAL_IC);
   error = LTC6811_rdcfg(TOTAL_IC, BMS_IC);
   check_error(error);  // Check error to enable the function
@@ -317,10 +985,11 @@ void set_all_discharge() {
 
 void stop_all_discharge() {
   int8_t error = 0;
-  uint32_t conv_time = 0;
   wakeup_sleep(TOTAL_IC);
-  LTC6811_clear_discharge(TOTAL_IC, BMS_IC);
-  LTC6811_wrcfg(TOTAL_IC, BMS_IC);
+  for (int i = 0; i < TOTAL_IC; i++) {
+    dcc_cache[i] = 0;
+  }
+  write_dcc(dcc_cache);
   wakeup_idle(TOTAL_IC);
   error = LTC6811_rdcfg(TOTAL_IC, BMS_IC);
   check_error(error);
@@ -329,286 +998,1871 @@ void stop_all_discharge() {
 }
 
 void check_stat() {
-  stop_all_discharge();
-  read_voltage();  // read and print the current voltage
-  calculate();     // calculate minimal and maxium
-  temp_detect();   // measure temperature and detect error
-  switch (status) {
-    case FAULT:
-      // Add a readpin to eliminate FAULT
-      digitalWrite(BMS_FAULT_PIN, LOW);
-      if (count % 4 == 0) {
-        Serial.print("********** FAULT **********\n\n");
-      }
-      break;
-    case WORK:
-      for (int current_ic = 0; current_ic < TOTAL_IC; current_ic++) {
-        if (vmax[current_ic] >= 4.2 || vmin[current_ic] <= 2.5) {
-          status = FAULT;
-          write_fault(0);
-        } else {
-          work_loop();
-          digitalWrite(BMS_FAULT_PIN, HIGH);
-        }
-      }
-      if (count % 4 == 0) {
-        Serial.print("********** WORK **********\n\n");
-      }
-      break;
-    case CHARGE:
-      for (int current_ic = 0; current_ic < TOTAL_IC; current_ic++) {
-        if (vmax[current_ic] >= 4.2 || vmin[current_ic] <= 2.5) {
-          status = FAULT;
-          write_fault(0);
-        } else {
-          charge_loop();
-          digitalWrite(BMS_FAULT_PIN, HIGH);
-        }
-      }
-      if (count % 4 == 0) {
-        Serial.print("********** CHARGE **********\n\n");
-      }
-      break;
-    default:
-      status = FAULT;
-      write_fault(4);
-      break;
+  uint32_t check = prof_start();
+  bms_cycle_ms = millis();
+  bms_in.fault = NO_FAULT;
+  bms_in.latching = false;
+
+  read_voltage();    // read, calculate statistics and print the voltage
+  voltage_detect();  // over charged / over discharged
+  uint32_t t = prof_start();
+  temp_detect();  // measure temperature and detect error
+  prof_end(PS_TEMP, t);
+  stale_detect();  // fault when an IC keeps failing PEC
+  if (count % DIE_TEMP_CYCLES == 0) {
+    t = prof_start();
+    die_temp_detect();
+    prof_end(PS_DIE, t);
   }
-}
+  spi_link_monitor();
+  if (manual_fault) {
+    raise_fault(4);
+  }
+  if (wcet_in_row >= OVERRUN_FAULT_MISSES) {
+    raise_fault(6);
+  }
+  charger_watch();
 
-void balance(double threshold) {
-  for (int current_ic = 0; current_ic < TOTAL_IC; current_ic++) {
-    for (int i = 0; i < BMS_IC[0].ic_reg.cell_channels; i++) {
-      if (abs(BMS_IC[current_ic].cells.c_codes[i] * 0.0001 -
-              consvmin[current_ic]) <= threshold) {
-        // Serial.print(abs(BMS_IC[current_ic].cells.c_codes[i] * 0.0001 -
-        //                  consvmin[current_ic]));
-        // Serial.println(", stop discharge");
-      } else if ((BMS_IC[current_ic].cells.c_codes[i] * 0.0001 -
-                  consvmin[current_ic]) > threshold) {
-        // Serial.print(BMS_IC[current_ic].cells.c_codes[i] * 0.0001 -
-        //              consvmin[current_ic]);
-        // Serial.println(", dischage");
-        select(current_ic, i + 1);
-      } else if ((BMS_IC[current_ic].cells.c_codes[i] * 0.0001 -
-                  consvmin[current_ic]) < -threshold) {
-        // Serial.print(BMS_IC[current_ic].cells.c_codes[i] * 0.0001 -
-        //              consvmin[current_ic]);
-        // Serial.println(", the other stop discharge");
-      }
-    }
+  bms_in.measured = true;
+  bms_in.clean_cycles =
+      (bms_in.fault == NO_FAULT) ? min(bms_in.clean_cycles + 1, 0xFFFF) : 0;
+  t = prof_start();
+  sm_step(&bms_in);
+  bms_in.clear_fault = false;
+  SM_STATES[state].run();
+  prof_end(PS_STATE, t);
+  log_write();
+
+  if (verbose_cycle()) {
+    Serial.print("********** ");
+    Serial.print(SM_STATES[state].name);
+    Serial.print(" **********\n\n");
   }
+  prof_end(PS_CHECK, check);
 }
 
-void set_ic_discharge(
-    int Cell,            // The cell to be discharged
-    uint8_t current_ic,  // The subsystem of the selected IC to be discharge
-    cell_asic *ic        // A two dimensional array that will store the data
-) {
-  if ((Cell < 9) && (Cell != 0)) {
-    ic[current_ic].config.tx_data[4] =
-        ic[current_ic].config.tx_data[4] | (1 << (Cell - 1));
-  } else if (Cell < 13) {
-    ic[current_ic].config.tx_data[5] =
-        ic[current_ic].config.tx_data[5] | (1 << (Cell - 9));
+void voltage_detect() {
+  if (stats.max >= cfg.vmax_code || stats.min <= cfg.vmin_code) {
+    raise_fault(0);
   }
 }
 
-void stop_ic_discharge(
-    int Cell,            // The cell to stop discharging
-    uint8_t current_ic,  // The subsystem of the selected IC to discharging
-    cell_asic *ic        // A two dimensional array that will store the data
-) {
-  switch (Cell) {
-    case 1:
-      ic[current_ic].config.tx_data[4] =
-          ic[current_ic].config.tx_data[4] & (0xFE);
-      break;
-    case 2:
-      ic[current_ic].config.tx_data[4] =
-          ic[current_ic].config.tx_data[4] & (0xFD);
-      break;
-    case 3:
-      ic[current_ic].config.tx_data[4] =
-          ic[current_ic].config.tx_data[4] & (0xFB);
-      break;
-    case 4:
-      ic[current_ic].config.tx_data[4] =
-          ic[current_ic].config.tx_data[4] & (0xF7);
-      break;
-    case 5:
-      ic[current_ic].config.tx_data[4] =
-          ic[current_ic].config.tx_data[4] & (0xEF);
-      break;
-    case 6:
-      ic[current_ic].config.tx_data[4] =
-          ic[current_ic].config.tx_data[4] & (0xDF);
-      break;
-    case 7:
-      ic[current_ic].config.tx_data[4] =
-          ic[current_ic].config.tx_data[4] & (0xBF);
-      break;
-    case 8:
-      ic[current_ic].config.tx_data[4] =
-          ic[current_ic].config.tx_data[4] & (0x7F);
-      break;
-    case 9:
-      ic[current_ic].config.tx_data[5] =
-          ic[current_ic].config.tx_data[5] & (0xFE);
-      break;
-    case 10:
-      ic[current_ic].config.tx_data[5] =
-          ic[current_ic].config.tx_data[5] & (0xFD);
-      break;
-    case 11:
-      ic[current_ic].config.tx_data[5] =
-          ic[current_ic].config.tx_data[5] & (0xFB);
-      break;
-    case 12:
-      ic[current_ic].config.tx_data[5] =
-          ic[current_ic].config.tx_data[5] & (0xF7);
-      break;
-    default:
-      break;
+void raise_fault(int reason) {
+  if (bms_in.fault == NO_FAULT) {
+    bms_in.fault = reason;
   }
+  bms_in.latching |= (reason != 5);  // stale data may clear by itself
+  write_fault(reason);
 }
 
-void calculate() {  // calculate minimal and maxium
-  for (int current_ic = 0; current_ic < TOTAL_IC; current_ic++) {
-    vmin[current_ic] = 5;
-    vmax[current_ic] = 0;
-    for (int i = 0; i < BMS_IC[0].ic_reg.cell_channels; i++) {
-      if (volt_bypass[current_ic][i] == 0) {
-        vmin[current_ic] > BMS_IC[current_ic].cells.c_codes[i] * 0.0001
-            ? vmin[current_ic] = BMS_IC[current_ic].cells.c_codes[i] * 0.0001
-            : 1;
-        vmax[current_ic] < BMS_IC[current_ic].cells.c_codes[i] * 0.0001
-            ? vmax[current_ic] = BMS_IC[current_ic].cells.c_codes[i] * 0.0001
-            : 1;
-
-        BMS_IC[current_ic].cells.c_codes[i] * 0.0001 >= 4.12
-            ? charge_finish[current_ic][i] = 1
-            : charge_finish[current_ic][i] = 0;
-      }
+uint8_t sm_next(uint8_t state, const sm_inputs *in) {
+  for (uint8_t i = 0; i < sizeof(SM_TABLE) / sizeof(SM_TABLE[0]); i++) {
+    if ((SM_TABLE[i].from & ST_BIT(state)) && SM_TABLE[i].guard(in)) {
+      return SM_TABLE[i].to;
     }
   }
+  return state;
 }
 
-void reset_vmin() {
-  for (int i = 0; i < TOTAL_IC; i++) {
-    consvmin[i] = vmin[i];  // Set up a costant Vminimum in case of the
-                            // minumum become lower and lower
+void sm_step(const sm_inputs *in) {
+  uint8_t next = sm_next(state, in);
+  if (next == state) {
+    return;
   }
-}
 
-void select(int ic, int cell) {
-  int8_t error = 0;
-  wakeup_sleep(TOTAL_IC);
-  set_ic_discharge(cell, ic, BMS_IC);
-  LTC6811_wrcfg(TOTAL_IC, BMS_IC);
-  error = LTC6811_rdcfg(TOTAL_IC, BMS_IC);
-  check_error(error);  // Check error to enable the function
-  wakeup_idle(TOTAL_IC);
+  uint32_t now = millis();
+  uint32_t dwell = now - sm_since;
+  sm_time[state].total_ms += dwell;
+  sm_time[state].max_ms = max(sm_time[state].max_ms, dwell);
+  SM_STATES[state].exit();
+
+  Serial.print(SM_STATES[state].name);
+  Serial.print(" -> ");
+  Serial.println(SM_STATES[next].name);
+  state = next;
+  sm_since = now;
+  sm_time[state].entries++;
+  SM_STATES[state].entry();
+  fault_crumb(state == ST_FAULT_LATCHED ? in->fault : NO_FAULT);
 }
 
-void charge_detect() {
-  int all = TOTAL_IC * 12;
-  int count = 0;
-  for (int i = 0; i < TOTAL_IC; i++) {
-    for (int j = 0; j < 12; j++) {
-      if (charge_finish[i][j] == 1) {
-        count++;
-      }
-      if (BMS_IC[i].cells.c_codes[j] * 0.0001 >= 4.13) {
-        select(i, j + 1);
-      }
+void print_sm_timing() {
+  for (int i = 0; i < ST_COUNT; i++) {
+    uint32_t total = sm_time[i].total_ms;
+    uint32_t longest = sm_time[i].max_ms;
+    if (i == state) {  // include the dwell that is still running
+      total += millis() - sm_since;
+      longest = max(longest, millis() - sm_since);
     }
-  }
-  if (count >= all * 0.9) {
-    status = FAULT;
-    write_fault(3);
+    Serial.print(SM_STATES[i].name);
+    Serial.print(": ");
+    Serial.print(sm_time[i].entries);
+    Serial.print(" entries, ");
+    Serial.print(total / 1000.0, 1);
+    Serial.print(" s total, ");
+    Serial.print(longest / 1000.0, 1);
+    Serial.println(" s max");
   }
 }
 
-void temp_detect() {
-  uint32_t conv_time = 0;
-  int8_t error = 0;
+void enter_safe() {
+  digitalWrite(BMS_FAULT_PIN, LOW);
+  stop_all_discharge();
+}
 
-  wakeup_sleep(TOTAL_IC);
-  LTC6811_adax(ADC_CONVERSION_MODE, AUX_CH_TO_CONVERT);
-  conv_time = LTC6811_pollAdc();
-  error =
-      LTC6811_rdaux(0, TOTAL_IC, BMS_IC);  // Set to read back all aux registers
-  check_error(error);
-  delay(100);
+void enter_ok() { digitalWrite(BMS_FAULT_PIN, HIGH); }
 
-  const float THSourceVoltage = 3.0;
-  const int THRES = 10000;
-  const float RT0 = 10000;  // The NTC resistance during 25 deg C
-  const float RT1 = 32650;  // The NTC resistance during 0 deg C
-  const float RT2 = 588.6;  // The NTC resistance during 100 deg C
-  const float T0 = 298.15;  // The Kelvin during 25 deg C
-  const float T1 = 273.15;  // The Kelvin during 0 deg C
-  const float T2 = 378.15;  // The Kelvin during 105 deg C
+void run_fault() {
+  // Add a readpin to eliminate FAULT
+  digitalWrite(BMS_FAULT_PIN, LOW);
+  stop_all_discharge();
+}
 
-  for (int current_ic = 0; current_ic < TOTAL_IC; current_ic++) {
-    for (int i = 0; i < 5; i++) {
-      // GPIO->V
-      // 10V/(5-V)= R = 10*exp(3984*(1/T-1/298.15))
-      // Rt = R*EXP(B*(1/T1-1/T2))
-      if (BMS_IC[current_ic].aux.a_codes[i] != 0) {
-        float VoltageOut;
-        float ROut;
-        float beta;
-        float Rx;
-        uint32_t KelvinValue;
+void run_none() {}
 
-        beta = (log(RT1 / RT2)) / ((1 / T1) - (1 / T2));
-        Rx = RT0 * exp(-beta / T0);
+bool g_fault_latch(const sm_inputs *in) {
+  return in->fault != NO_FAULT && in->latching;
+}
 
-        VoltageOut = BMS_IC[current_ic].aux.a_codes[i] * 0.0001;
+bool g_fault_recover(const sm_inputs *in) { return in->fault != NO_FAULT; }
 
-        ROut = THRES * VoltageOut /
-               (THSourceVoltage - VoltageOut);  // current NTC resistance
-        KelvinValue = (beta / log(ROut / Rx));
+bool g_recovered(const sm_inputs *in) {
+  return in->clean_cycles >= FAULT_RECOVER_CYCLES;
+}
 
-        temp[current_ic][i] = KelvinValue - 273.15;  // Kelvin to deg C
-      }
-    }
-  }
+bool g_cleared(const sm_inputs *in) {
+  return in->clear_fault && in->fault == NO_FAULT;
+}
 
-  if (count % 4 == 0) {
-    for (int current_ic = 0; current_ic < TOTAL_IC; current_ic++) {
-      Serial.print(" IC ");
-      Serial.print(current_ic + 1, DEC);
-      Serial.print(": ");
-      for (int i = 0; i < 5; i++) {
-        Serial.print(temp[current_ic][i]);
-        Serial.print(", ");
-      }
-      Serial.print("\n");
-    }
-    Serial.print("\n");
-  }
+bool g_measured(const sm_inputs *in) { return in->measured; }
 
-  error_temp();
+bool g_want_drive(const sm_inputs *in) { return in->request == REQ_DRIVE; }
+
+bool g_want_charge(const sm_inputs *in) {
+  return in->request == REQ_CHARGE && in->charger && !in->charge_done;
 }
 
-void error_temp() {
-  for (int current_ic = 0; current_ic < TOTAL_IC; current_ic++) {
-    for (int i = 0; i < 5; i++) {
-      if (temp[current_ic][i] > 60 && temp_bypass[current_ic][i] == 0) {
-        Serial.print("[");
-        Serial.print(current_ic + 1, DEC);
-        Serial.print("]");
-        Serial.print("[");
-        Serial.print(i);
-        Serial.print("]");
+bool g_want_balance(const sm_inputs *in) {
+  return in->request == REQ_BALANCE;
+}
 
-        status = FAULT;
-        write_fault(1);
-      }
-      if (temp[current_ic][i] <= 0 && temp_bypass[current_ic][i] == 0) {
+bool g_leave_drive(const sm_inputs *in) { return in->request != REQ_DRIVE; }
+
+bool g_leave_charge(const sm_inputs *in) {
+  return in->request != REQ_CHARGE || in->charge_done;
+}
+
+bool g_leave_balance(const sm_inputs *in) {
+  return in->request != REQ_BALANCE;
+}
+
+void charge_control() {
+  // CC until the highest cell reaches cfg.charge_cv_code, then a PI loop on
+  // that cell tapers the request. The charge ends once both the request and
+  // the measured current stay under cfg.charge_end_a.
+  uint32_t now = millis();
+  float dt = (now - charger.last_ms) / 1000.0;
+  charger.last_ms = now;
+  if (dt > CHARGE_PERIOD_MS * 2 / 1000.0) {
+    dt = CHARGE_PERIOD_MS / 1000.0;  // first period or a stalled loop
+  }
+
+  charger.current_a = read_pack_current();
+  charger.derate = charge_derate();
+  float limit = cfg.charge_cc_a * charger.derate;
+  float request = limit;
+
+  if (charger.stage == CHG_CC && stats.max >= cfg.charge_cv_code) {
+    charger.stage = CHG_CV;
+    charger.integral = charger.setpoint_a;  // bumpless hand-over
+  }
+  if (charger.stage == CHG_CV) {
+    float error = (cfg.charge_cv_code - (float)stats.max) * 0.0001;  // V
+    charger.integral =
+        constrain(charger.integral + CHARGE_KI * error * dt, 0, limit);
+    request = constrain(CHARGE_KP * error + charger.integral, 0, limit);
+  }
+  if (charger.stage == CHG_DONE) {
+    request = 0;
+  }
+
+  // Ramp up gently, cut immediately
+  charger.setpoint_a = min(request, charger.setpoint_a + CHARGE_SLEW_A);
+  charger.voltage_v = cfg.charge_cv_code * 0.0001 * TOTAL_IC * CELLS_PER_IC;
+
+  if (charger.stage == CHG_CV &&
+      max(charger.setpoint_a, charger.current_a) < cfg.charge_end_a) {
+    if (++charger.end_periods >= CHARGE_END_PERIODS) {
+      charger.stage = CHG_DONE;
+      charger.setpoint_a = 0;
+      bms_in.charge_done = true;  // CHARGE -> IDLE
+      write_fault(3);
+    }
+  } else {
+    charger.end_periods = 0;
+  }
+
+  if (verbose_cycle()) {
+    Serial.print("Charge ");
+    Serial.print(charger.stage == CHG_CC   ? "CC"
+                 : charger.stage == CHG_CV ? "CV"
+                                           : "done");
+    Serial.print(": request ");
+    Serial.print(charger.setpoint_a, 2);
+    Serial.print(" A, measured ");
+    Serial.print(charger.current_a, 2);
+    Serial.print(" A, derate ");
+    Serial.println(charger.derate, 2);
+  }
+}
+
+void charge_reset() {
+  charger.stage = CHG_CC;
+  charger.setpoint_a = 0;
+  charger.integral = 0;
+  charger.end_periods = 0;
+  charger.last_ms = millis();
+}
+
+float read_pack_current() {
+  float volts = analogRead(PACK_CURRENT_PIN) * 3.3 / 4095;
+  return (volts - CURRENT_SENSOR_OFFSET) / CURRENT_SENSOR_GAIN;
+}
+
+float charge_derate() {
+  // Li-ion must not be charged when cold, reduced while cool, full current
+  // up to charge_t_hot, then linearly down to nothing at charge_t_max.
+  // Without a single valid NTC the cell temperature is unknown: no charge.
+  int16_t hot, cold;
+  if (!temp_extremes(&hot, &cold)) {
+    return 0;
+  }
+  if (cold <= cfg.charge_t_min || hot >= cfg.charge_t_max) {
+    return 0;
+  }
+  if (hot > cfg.charge_t_hot) {
+    return (float)(cfg.charge_t_max - hot) /
+           (cfg.charge_t_max - cfg.charge_t_hot);
+  }
+  return cold < cfg.charge_t_cold ? 0.5 : 1;
+}
+
+bool temp_extremes(int16_t *hot, int16_t *cold) {
+  bool any = false;
+  *hot = -100;
+  *cold = 100;
+  for (int current_ic = 0; current_ic < TOTAL_IC; current_ic++) {
+    for (int i = 0; i < TEMPS_PER_IC; i++) {
+      if (pack.temp_valid[current_ic] & (1 << i)) {
+        int16_t t = pack.temp[current_ic * TEMPS_PER_IC + i];
+        *hot = max(*hot, t);
+        *cold = min(*cold, t);
+        any = true;
+      }
+    }
+  }
+  return any;
+}
+
+float discharge_limit() {
+  if (state != ST_DRIVE && state != ST_IDLE) {
+    return 0;
+  }
+  int16_t hot, cold;
+  temp_extremes(&hot, &cold);
+  float volt = (float)(stats.min - cfg.vmin_code) /
+               (DISCHARGE_TAPER_CODE - cfg.vmin_code);
+  float heat = (cfg.temp_max - hot) / 10.0;  // last 10 deg C before the max
+  return DISCHARGE_MAX_A * constrain(min(volt, heat), 0, 1);
+}
+
+void enter_charge() {
+  enter_ok();
+  charge_reset();
+}
+
+void exit_charge() {
+  stop_all_discharge();
+  charger.stage = charger.stage == CHG_DONE ? CHG_DONE : CHG_OFF;
+  charger.setpoint_a = 0;
+}
+
+void can_setup() {
+  pmc_enable_periph_clk(ID_CAN0);
+  can_ok = can_init(CAN0, SystemCoreClock, CAN_BAUD);
+  if (!can_ok) {
+    Serial.println(F("CAN initialization failed!"));
+    return;
+  }
+  can_reset_all_mailbox(CAN0);
+
+  can_mb_conf_t mb = {0};
+  for (uint8_t i = 0; i < CAN_TX_MBS; i++) {
+    mb.ul_mb_idx = i;
+    mb.uc_obj_type = CAN_MB_TX_MODE;
+    mb.uc_tx_prio = i;
+    can_mailbox_init(CAN0, &mb);
+  }
+  mb.ul_mb_idx = CAN_RX_MB;
+  mb.uc_obj_type = CAN_MB_RX_MODE;
+  mb.ul_id_msk = CAN_MAM_MIDvA_Msk;
+  mb.ul_id = CAN_MID_MIDvA(CAN_ID_COMMAND);
+  can_mailbox_init(CAN0, &mb);
+  mb.ul_mb_idx = CAN_CONFIG_MB;
+  mb.ul_id = CAN_MID_MIDvA(CAN_ID_CONFIG);
+  can_mailbox_init(CAN0, &mb);
+  mb.ul_mb_idx = CAN_CHARGER_MB;
+  mb.uc_id_ver = 1;
+  mb.ul_id_msk = 0x1FFFFFFF;
+  mb.ul_id = CAN_ID_CHARGER_STAT & 0x1FFFFFFF;
+  can_mailbox_init(CAN0, &mb);
+
+  // Spread the first frames so they don't all fall due at once
+  uint32_t now = millis();
+  for (uint8_t i = 0; i < sizeof(CAN_SCHEDULE) / sizeof(CAN_SCHEDULE[0]); i++) {
+    CAN_SCHEDULE[i].due_ms = now + i * 5;
+  }
+  can_refill_ms = now;
+}
+
+void can_service() {
+  if (!can_ok) {
+    return;
+  }
+  uint32_t now = millis();
+  can_budget = min(can_budget + (now - can_refill_ms) * CAN_BAUD *
+                                    CAN_LOAD_PCT / 100,
+                   (uint32_t)CAN_BURST_BITS);
+  can_refill_ms = now;
+  can_receive();
+
+  for (uint8_t mb = 0; mb < CAN_TX_MBS; mb++) {
+    if (!(can_mailbox_get_status(CAN0, mb) & CAN_MSR_MRDY)) {
+      continue;  // still sending
+    }
+    // Most overdue frame first
+    can_msg *next = NULL;
+    for (uint8_t i = 0; i < sizeof(CAN_SCHEDULE) / sizeof(CAN_SCHEDULE[0]);
+         i++) {
+      can_msg *m = &CAN_SCHEDULE[i];
+      if ((int32_t)(now - m->due_ms) >= 0 &&
+          (next == NULL || (int32_t)(m->due_ms - next->due_ms) < 0)) {
+        next = m;
+      }
+    }
+    if (next == NULL) {
+      return;
+    }
+    uint16_t bits = can_frame_bits(next->dlc, next->id & CAN_EXT);
+    if (can_budget < bits) {
+      return;
+    }
+
+    uint8_t data[8] = {0};
+    next->encode(next->page, data);
+    if (!can_write(mb, next->id, data, next->dlc)) {
+      return;
+    }
+    can_budget -= bits;
+    can_sent++;
+    next->page = (next->page + 1) % next->pages;
+    next->due_ms += next->period_ms;
+    if ((int32_t)(now - next->due_ms) >= next->period_ms) {
+      next->due_ms = now + next->period_ms;  // don't burst to catch up
+      can_late++;
+    }
+  }
+}
+
+bool can_write(uint8_t mb, uint32_t id, const uint8_t *data, uint8_t dlc) {
+  can_mb_conf_t frame = {0};
+  frame.ul_mb_idx = mb;
+  frame.uc_obj_type = CAN_MB_TX_MODE;
+  frame.uc_id_ver = (id & CAN_EXT) ? 1 : 0;
+  frame.ul_id = (id & CAN_EXT) ? (id & 0x1FFFFFFF) : CAN_MID_MIDvA(id);
+  frame.uc_length = dlc;
+  frame.ul_datal = data[0] | (data[1] << 8) | (data[2] << 16) |
+                   ((uint32_t)data[3] << 24);
+  frame.ul_datah = data[4] | (data[5] << 8) | (data[6] << 16) |
+                   ((uint32_t)data[7] << 24);
+  if (can_mailbox_write(CAN0, &frame) != 0) {
+    return false;
+  }
+  can_global_send_transfer_cmd(CAN0, CAN_TCR_MB0 << mb);
+  return true;
+}
+
+void can_receive() {
+  const uint8_t rx[] = {CAN_RX_MB, CAN_CHARGER_MB, CAN_CONFIG_MB};
+  for (uint8_t i = 0; i < sizeof(rx); i++) {
+    if (!(can_mailbox_get_status(CAN0, rx[i]) & CAN_MSR_MRDY)) {
+      continue;
+    }
+    can_mb_conf_t frame = {0};
+    frame.ul_mb_idx = rx[i];
+    can_mailbox_read(CAN0, &frame);  // also arms the mailbox again
+    uint8_t data[8];
+    for (int k = 0; k < 4; k++) {
+      data[k] = (frame.ul_datal >> (8 * k)) & 0xFF;
+      data[4 + k] = (frame.ul_datah >> (8 * k)) & 0xFF;
+    }
+    if (rx[i] == CAN_RX_MB) {
+      can_command(data);
+    } else if (rx[i] == CAN_CONFIG_MB) {
+      can_config(data);
+    } else {
+      charger_status(data);
+    }
+  }
+}
+
+void can_command(const uint8_t *data) {
+  // BMS_Command: byte 0 request (0xFF keeps it), byte 1 bit 0 clear fault
+  if (data[0] <= REQ_BALANCE && data[0] != bms_in.request) {
+    bms_in.request = data[0];
+    bms_in.charge_done = false;
+  }
+  // ClearFault only asks: g_cleared() leaves FAULT_LATCHED if the cycle that
+  // follows raised nothing, so a cause still there (a manual fault too, that
+  // is only cleared from the console) keeps it latched. A bit the ECU keeps
+  // sending is taken once per CAN_CLEAR_MS, not in every cycle.
+  if ((data[1] & 0x01) && millis() - can_clear_ms >= CAN_CLEAR_MS) {
+    can_clear_ms = millis();
+    bms_in.clear_fault = true;
+  }
+}
+
+void can_config(const uint8_t *data) {
+  // BMS_ConfigSet: byte 0 CONFIG_PARAMS index, bytes 1..4 signed value
+  // (thousandths for CFG_F32), byte 5 bit 0 saves to flash afterwards
+  if (data[0] >= sizeof(CONFIG_PARAMS) / sizeof(CONFIG_PARAMS[0])) {
+    return;
+  }
+  int32_t raw = data[1] | (data[2] << 8) | (data[3] << 16) |
+                ((uint32_t)data[4] << 24);
+  float value = CONFIG_PARAMS[data[0]].type == CFG_F32 ? raw * 0.001 : raw;
+  if (config_set(data[0], value) && (data[5] & 0x01)) {
+    config_save();
+  }
+}
+
+uint16_t can_frame_bits(uint8_t dlc, bool ext) {
+  // 47 bits of framing for an 11-bit identifier, 67 for a 29-bit one, plus
+  // one stuff bit per 4 worst case over the bits that are stuffed
+  uint8_t head = ext ? 54 : 34;
+  return head + 13 + 8 * dlc + (head + 8 * dlc - 1) / 4;
+}
+
+void idle_wait(uint32_t ms) {
+  uint32_t start = millis();
+  do {
+    can_service();
+    yield();
+  } while (millis() - start < ms);
+}
+
+void put_u16(uint8_t *data, uint16_t value) {
+  data[0] = value & 0xFF;
+  data[1] = value >> 8;
+}
+
+void put_u16_be(uint8_t *data, uint16_t value) {
+  data[0] = value >> 8;
+  data[1] = value & 0xFF;
+}
+
+void can_summary(uint8_t page, uint8_t *data) {
+  put_u16(&data[0], stats.min);
+  put_u16(&data[2], stats.max);
+  put_u16(&data[4], stats.sum / 100);  // 10mV
+  data[6] = stats.min_ic * CELLS_PER_IC + stats.min_cell;
+  data[7] = stats.max_ic * CELLS_PER_IC + stats.max_cell;
+}
+
+void can_cells(uint8_t page, uint8_t *data) {
+  data[0] = page;
+  for (int k = 0; k < CAN_CELLS_PER_PAGE; k++) {
+    int cell = page * CAN_CELLS_PER_PAGE + k;
+    if (cell >= TOTAL_IC * CELLS_PER_IC) {
+      break;
+    }
+    int ic = cell / CELLS_PER_IC;
+    put_u16(&data[1 + 2 * k], pack.voltage[cell]);
+    if (pack.volt_valid[ic] & (1 << (cell % CELLS_PER_IC))) {
+      data[7] |= 1 << k;
+    }
+    if (cell_stale[ic] & (1 << (cell % CELLS_PER_IC))) {
+      data[7] |= 1 << (k + 3);
+    }
+  }
+}
+
+void can_temps(uint8_t page, uint8_t *data) {
+  data[0] = page;
+  for (int k = 0; k < CAN_TEMPS_PER_PAGE; k++) {
+    int ntc = page * CAN_TEMPS_PER_PAGE + k;
+    int8_t t = CAN_NO_TEMP;
+    if (ntc < TOTAL_IC * TEMPS_PER_IC &&
+        (pack.temp_valid[ntc / TEMPS_PER_IC] & (1 << (ntc % TEMPS_PER_IC)))) {
+      t = constrain(pack.temp[ntc], -127, 127);
+    }
+    data[1 + k] = (uint8_t)t;
+  }
+}
+
+void can_status(uint8_t page, uint8_t *data) {
+  uint16_t stale = 0;
+  for (int current_ic = 0; current_ic < TOTAL_IC; current_ic++) {
+    if (cell_stale[current_ic] || aux_stale[current_ic]) {
+      stale |= 1 << current_ic;
+    }
+  }
+  data[0] = state;
+  data[1] = (uint8_t)bms_in.fault;
+  data[2] = bms_in.latching | (bms_in.charge_done << 1) |
+            ((state >= ST_FAULT_RECOVERABLE) << 2) | ((spi_level > 0) << 3);
+  data[3] = spi_level;
+  put_u16(&data[4], stale);
+  data[6] = min(pec_total(), (uint32_t)255);
+  data[7] = can_alive++;
+}
+
+void can_limits(uint8_t page, uint8_t *data) {
+  data[0] = soc_from_code(stats.mean * 10000) * 200;  // 0.5%
+  put_u16(&data[1], discharge_limit() * 10);           // 0.1A
+  put_u16(&data[3], state == ST_CHARGE ? charger.setpoint_a * 10 : 0);
+  put_u16(&data[5], charger.voltage_v * 10);  // 0.1V
+  data[7] = charge_derate() * 100;
+}
+
+void can_balance(uint8_t page, uint8_t *data) {
+  // Minutes until the pack is balanced, 0xFFFF while no plan is running
+  bool planning = BALANCE_PWM && (state == ST_DRIVE || state == ST_CHARGE ||
+                                  state == ST_BALANCE);
+  put_u16(&data[0], planning ? min(bal_eta_h * 60 + 0.5f, 65534.0f) : 0xFFFF);
+}
+
+void can_charger_req(uint8_t page, uint8_t *data) {
+  // Sent every CHARGER_REQ_MS whatever the state, so a stop reaches the
+  // charger within one cycle instead of waiting for its own timeout
+  bool run = charger_may_run();
+  put_u16_be(&data[0], run ? charger.voltage_v * 10 : 0);
+  put_u16_be(&data[2], run ? charger.setpoint_a * 10 : 0);
+  data[4] = run ? 0 : 1;  // 0: charge, 1: stop
+}
+
+bool charger_may_run() {
+  return state == ST_CHARGE && charger.stage != CHG_DONE &&
+         millis() - bms_cycle_ms < BMS_STATE_TIMEOUT_MS && obc.online &&
+         obc.flags == 0;
+}
+
+void charger_status(const uint8_t *data) {
+  obc.voltage_v = ((data[0] << 8) | data[1]) * 0.1;
+  obc.current_a = ((data[2] << 8) | data[3]) * 0.1;
+  obc.flags = data[4];  // hardware, over temp, input, no battery, timeout
+  obc.seen_ms = millis();
+}
+
+void charger_watch() {
+  bool online =
+      obc.seen_ms != 0 && millis() - obc.seen_ms < CHARGER_TIMEOUT_MS;
+  // A charger on the bus is not a request to charge, CHARGE also needs
+  // the ECU's BMS_Command or the console's mode charge
+  if (online && !obc.online) {
+    Serial.println(F("Charger connected"));
+  } else if (!online && obc.online) {
+    Serial.println(F("Charger lost"));
+    if (bms_in.request == REQ_CHARGE) {
+      bms_in.request = REQ_IDLE;
+    }
+  }
+  obc.online = online;
+  bms_in.charger = online;
+
+  if (state == ST_CHARGE && obc.flags != 0) {
+    Serial.print(F("Charger reports status 0x"));
+    Serial.println(obc.flags, HEX);
+    bms_in.request = REQ_IDLE;
+  }
+}
+
+void console_poll() {
+  uint32_t start = micros();
+
+  // Leave what doesn't fit in the UART buffer for the next loop
+  while (Serial.available() > 0) {
+    if (con_discard) {  // up to the end of the dropped line, not a new one
+      char c = Serial.read();
+      con_discard = c != '\n' && c != '\r';
+      continue;
+    }
+    uint8_t next = (con_head + 1) % CONSOLE_RING;
+    if (next == con_tail) {
+      if (con_lines == 0) {  // one line fills the ring, drop all of it
+        Serial.println(F("Line too long, dropped"));
+        con_tail = con_head;
+        con_discard = true;
+        continue;
+      }
+      break;
+    }
+    char c = Serial.read();
+    con_ring[con_head] = c;
+    con_head = next;
+    con_lines += (c == '\n' || c == '\r');
+  }
+
+  while (con_lines > 0 && micros() - start < CONSOLE_BUDGET_US) {
+    char line[CONSOLE_LINE];
+    uint8_t n = 0;
+    while (true) {
+      char c = con_ring[con_tail];
+      con_tail = (con_tail + 1) % CONSOLE_RING;
+      if (c == '\n' || c == '\r') {
+        break;
+      }
+      if (n < CONSOLE_LINE - 1) {
+        line[n++] = c;
+      }
+    }
+    line[n] = '\0';
+    con_lines--;
+    console_exec(line);
+  }
+}
+
+void console_exec(char *line) {
+  char *argv[CONSOLE_ARGS];
+  uint8_t argc = 0;
+  for (char *word = strtok(line, " \t"); word != NULL && argc < CONSOLE_ARGS;
+       word = strtok(NULL, " \t")) {
+    argv[argc++] = word;
+  }
+  if (argc == 0) {
+    return;  // blank line, or the \n of a \r\n
+  }
+  for (uint8_t i = 0; i < sizeof(CONSOLE_CMDS) / sizeof(CONSOLE_CMDS[0]); i++) {
+    if (strcmp(argv[0], CONSOLE_CMDS[i].name) == 0) {
+      CONSOLE_CMDS[i].run(argc, argv);
+      return;
+    }
+  }
+  Serial.print(F("Unknown command: "));
+  Serial.print(argv[0]);
+  Serial.println(F(", try help"));
+}
+
+bool console_num(const char *arg, long lo, long hi, long *value) {
+  char *end;
+  *value = strtol(arg, &end, 0);
+  if (*end != '\0' || *value < lo || *value > hi) {
+    Serial.print(F("Expected "));
+    Serial.print(lo);
+    Serial.print(F(".."));
+    Serial.print(hi);
+    Serial.print(F(", got "));
+    Serial.println(arg);
+    return false;
+  }
+  return true;
+}
+
+void cmd_help(uint8_t argc, char **argv) {
+  for (uint8_t i = 0; i < sizeof(CONSOLE_CMDS) / sizeof(CONSOLE_CMDS[0]); i++) {
+    Serial.print(CONSOLE_CMDS[i].name);
+    Serial.print(" ");
+    Serial.println(CONSOLE_CMDS[i].help);
+  }
+}
+
+void cmd_clear(uint8_t argc, char **argv) {
+  Serial.print("******** clear fault *******\n");
+  manual_fault = false;
+  bms_in.clear_fault = true;
+}
+
+void cmd_fault(uint8_t argc, char **argv) { manual_fault = true; }
+
+void cmd_mode(uint8_t argc, char **argv) {
+  const char *MODES[] = {"idle", "drive", "charge", "balance"};  // bms_request
+  for (uint8_t i = 0; argc == 2 && i < 4; i++) {
+    if (strcmp(argv[1], MODES[i]) == 0) {
+      bms_in.request = i;
+      bms_in.charge_done = false;
+      return;
+    }
+  }
+  Serial.println(F("mode idle|drive|charge|balance"));
+}
+
+void cmd_discharge(uint8_t argc, char **argv) {
+  if (argc == 2 && strcmp(argv[1], "all") == 0) {
+    Serial.print("******* dicharge all *******\n");
+    set_all_discharge();
+  } else if (argc == 2 && strcmp(argv[1], "off") == 0) {
+    Serial.print("****** stop discharge ******\n");
+    stop_all_discharge();
+  } else {
+    Serial.println(F("discharge all|off"));
+  }
+}
+
+void cmd_balance(uint8_t argc, char **argv) {
+  long ic, cell;
+  if (argc != 4 || !console_num(argv[1], 0, TOTAL_IC - 1, &ic) ||
+      !console_num(argv[2], 1, CELLS_PER_IC, &cell)) {
+    Serial.println(F("balance <ic 0-9> <cell 1-12> on|off"));
+    return;
+  }
+  if (strcmp(argv[3], "on") == 0) {
+    select(ic, cell);
+  } else {
+    dcc_cache[ic] &= ~(1 << (cell - 1));
+    write_dcc(dcc_cache);
+  }
+}
+
+void cmd_set(uint8_t argc, char **argv) {
+  for (uint8_t i = 0;
+       argc == 3 && i < sizeof(CONFIG_PARAMS) / sizeof(CONFIG_PARAMS[0]); i++) {
+    if (strcmp(argv[1], CONFIG_PARAMS[i].name) == 0) {
+      char *end;
+      float value = strtod(argv[2], &end);
+      if (*end != '\0' || value < CONFIG_PARAMS[i].lo ||
+          value > CONFIG_PARAMS[i].hi) {
+        Serial.print(F("Expected "));
+        Serial.print(CONFIG_PARAMS[i].lo);
+        Serial.print(F(".."));
+        Serial.println(CONFIG_PARAMS[i].hi);
+        return;
+      }
+      config_set(i, value);  // says so itself if the ordering breaks
+      return;
+    }
+  }
+  Serial.println(F("set <name> <value>, see config show"));
+}
+
+void cmd_bypass(uint8_t argc, char **argv) {
+  bool volt = argc >= 2 && strcmp(argv[1], "volt") == 0;
+  long ic, bit;
+  if (argc < 4 || (!volt && strcmp(argv[1], "temp") != 0) ||
+      !console_num(argv[2], 0, TOTAL_IC - 1, &ic) ||
+      !console_num(argv[3], 0, volt ? CELLS_PER_IC - 1 : TEMPS_PER_IC - 1,
+                   &bit)) {
+    Serial.println(F("bypass volt|temp <ic 0-9> <bit> [off]"));
+    return;
+  }
+  uint16_t *bypass = volt ? cfg.volt_bypass : cfg.temp_bypass;
+  if (argc == 5 && strcmp(argv[4], "off") == 0) {
+    bypass[ic] &= ~(1 << bit);
+  } else {
+    bypass[ic] |= 1 << bit;
+  }
+}
+
+void cmd_dump(uint8_t argc, char **argv) {
+  const char *what = argc == 2 ? argv[1] : "";
+  if (strcmp(what, "stats") == 0) {
+    Serial.print(F("min "));
+    Serial.print(stats.min * 0.0001, 4);
+    Serial.print(F(" V (IC "));
+    Serial.print(stats.min_ic);
+    Serial.print(F(" cell "));
+    Serial.print(stats.min_cell + 1);
+    Serial.print(F("), max "));
+    Serial.print(stats.max * 0.0001, 4);
+    Serial.print(F(" V (IC "));
+    Serial.print(stats.max_ic);
+    Serial.print(F(" cell "));
+    Serial.print(stats.max_cell + 1);
+    Serial.print(F("), sum "));
+    Serial.print(stats.sum * 0.0001, 2);
+    Serial.print(F(" V, mean "));
+    Serial.print(stats.mean, 4);
+    Serial.print(F(" V, stdev "));
+    Serial.print(stats.stdev, 4);
+    Serial.print(F(" V, "));
+    Serial.print(stats.n);
+    Serial.println(F(" cells"));
+  } else if (strcmp(what, "cells") == 0) {
+    print_cells(0);
+  } else if (strcmp(what, "temps") == 0) {
+    for (int current_ic = 0; current_ic < TOTAL_IC; current_ic++) {
+      Serial.print(" IC ");
+      Serial.print(current_ic + 1, DEC);
+      Serial.print(": ");
+      for (int i = 0; i < TEMPS_PER_IC; i++) {
+        Serial.print(pack.temp[current_ic * TEMPS_PER_IC + i]);
+        Serial.print(", ");
+      }
+      Serial.print("\n");
+    }
+  } else if (strcmp(what, "timing") == 0) {
+    print_sm_timing();
+  } else if (strcmp(what, "duty") == 0) {
+    print_duty();
+  } else if (strcmp(what, "can") == 0) {
+    Serial.print(F("CAN "));
+    Serial.print(can_ok ? F("up") : F("down"));
+    Serial.print(F(", sent "));
+    Serial.print(can_sent);
+    Serial.print(F(", late "));
+    Serial.println(can_late);
+  } else if (strcmp(what, "charger") == 0) {
+    Serial.print(obc.online ? F("Charger online, ") : F("Charger offline, "));
+    Serial.print(obc.voltage_v, 1);
+    Serial.print(F(" V, "));
+    Serial.print(obc.current_a, 1);
+    Serial.print(F(" A, status 0x"));
+    Serial.println(obc.flags, HEX);
+  } else {
+    Serial.println(F("dump stats|cells|temps|timing|duty|can|charger"));
+  }
+}
+
+void cmd_vmin(uint8_t argc, char **argv) {
+  Serial.print("********* reset vmin *******\n");
+  reset_vmin();
+}
+
+void cmd_bench(uint8_t argc, char **argv) {
+  Serial.print("******** bench pack ********\n");
+  bench_pack();
+}
+
+void cmd_config(uint8_t argc, char **argv) {
+  const char *what = argc == 2 ? argv[1] : "";
+  if (strcmp(what, "show") == 0) {
+    config_print();
+  } else if (strcmp(what, "save") == 0) {
+    if (config_save()) {
+      Serial.print(F("Config saved to page "));
+      Serial.println(cfg_page);
+    }
+  } else if (strcmp(what, "defaults") == 0) {
+    uint32_t sequence = cfg.sequence;
+    config_defaults();
+    cfg.sequence = sequence;  // still newer than both pages once saved
+    config_apply();
+  } else {
+    Serial.println(F("config show|save|defaults"));
+  }
+}
+
+void config_defaults() {
+  memset(&cfg, 0, sizeof(cfg));
+  cfg.vmax_code = VMAX_CODE;
+  cfg.vmin_code = VMIN_CODE;
+  cfg.charged_code = CHARGED_CODE;
+  cfg.charge_stop_code = CHARGE_STOP_CODE;
+  cfg.charge_cv_code = CHARGE_CV_CODE;
+  cfg.ov_code = OV_THRESHOLD;
+  cfg.uv_code = UV_THRESHOLD;
+  cfg.temp_max = TEMP_MAX;
+  cfg.temp_min = TEMP_MIN;
+  cfg.bal_drive = BAL_DRIVE;
+  cfg.bal_charge = BAL_CHARGE;
+  cfg.bal_only = BAL_ONLY;
+  cfg.charge_cc_a = CHARGE_CC_A;
+  cfg.charge_end_a = CHARGE_END_A;
+  cfg.charge_t_min = CHARGE_T_MIN;
+  cfg.charge_t_cold = CHARGE_T_COLD;
+  cfg.charge_t_hot = CHARGE_T_HOT;
+  cfg.charge_t_max = CHARGE_T_MAX;
+
+  // ******** By pass list *********
+  // cfg.volt_bypass[9] |= (1 << 11);
+  cfg.temp_bypass[7] |= (1 << 4);
+}
+
+void config_load() {
+  // A page only counts with the current CONFIG_VERSION, an older layout
+  // falls back to the defaults instead of being read with the wrong offsets
+  int8_t best = -1;
+  for (uint8_t page = 0; page < CONFIG_PAGES; page++) {
+    const bms_config *c = (const bms_config *)config_page(page);
+    if (config_check(c) &&
+        (best < 0 ||
+         (int32_t)(c->sequence -
+                   ((const bms_config *)config_page(best))->sequence) > 0)) {
+      best = page;
+    }
+  }
+  if (best < 0) {
+    Serial.println(F("Config: no valid page, using defaults"));
+    config_defaults();
+    cfg_page = CONFIG_PAGES - 1;  // first save goes to page 0
+    return;
+  }
+  memcpy(&cfg, config_page(best), sizeof(cfg));
+  cfg_page = best;
+  Serial.print(F("Config: page "));
+  Serial.print(cfg_page);
+  Serial.print(F(", sequence "));
+  Serial.println(cfg.sequence);
+  const char *conflict = config_conflict(&cfg);
+  if (conflict != NULL) {
+    uint32_t sequence = cfg.sequence;
+    config_defaults();
+    cfg.sequence = sequence;  // so the next save wins over this page
+    Serial.print(F("Config: needs "));
+    Serial.print(conflict);
+    Serial.println(F(", using defaults"));
+  }
+}
+
+bool config_save() {
+  // The page being replaced is never the one cfg was loaded from, so a reset
+  // in the middle of the erase/write still leaves the previous copy valid
+  uint8_t page = (cfg_page + 1) % CONFIG_PAGES;
+  cfg.version = CONFIG_VERSION;
+  cfg.length = sizeof(bms_config);
+  cfg.sequence++;
+  cfg.crc = crc32((const uint8_t *)&cfg, offsetof(bms_config, crc));
+
+  uint32_t words[IFLASH1_PAGE_SIZE / 4];
+  memset(words, 0xFF, sizeof(words));
+  memcpy(words, &cfg, sizeof(cfg));
+  volatile uint32_t *latch = (volatile uint32_t *)config_page(page);
+  for (uint16_t i = 0; i < IFLASH1_PAGE_SIZE / 4; i++) {
+    latch[i] = words[i];  // writes land in the EFC page buffer
+  }
+  uint32_t rc = efc_perform_command(
+      EFC1, EFC_FCMD_EWP, IFLASH1_NB_OF_PAGES - CONFIG_PAGES + page);
+  if (rc != 0 || memcmp(config_page(page), &cfg, sizeof(cfg)) != 0) {
+    Serial.println(F("Config: flash write failed"));
+    return false;
+  }
+  cfg_page = page;
+  return true;
+}
+
+bool config_check(const void *block) {
+  const bms_config *c = (const bms_config *)block;
+  return c->version == CONFIG_VERSION && c->length == sizeof(bms_config) &&
+         c->crc == crc32((const uint8_t *)c, offsetof(bms_config, crc));
+}
+
+uint8_t *config_page(uint8_t page) {
+  return (uint8_t *)IFLASH1_ADDR +
+         (IFLASH1_NB_OF_PAGES - CONFIG_PAGES + page) * IFLASH1_PAGE_SIZE;
+}
+
+bool config_set(uint8_t index, float value) {
+  const config_param *param = &CONFIG_PARAMS[index];
+  if (value < param->lo || value > param->hi) {
+    return false;
+  }
+  bms_config before = cfg;
+  switch (param->type) {
+    case CFG_U16:
+      *(uint16_t *)param->field = value;
+      break;
+    case CFG_I16:
+      *(int16_t *)param->field = value;
+      break;
+    case CFG_F32:
+      *(float *)param->field = value;
+      break;
+  }
+  const char *conflict = config_conflict(&cfg);
+  if (conflict != NULL) {
+    cfg = before;
+    Serial.print(F("Not set, needs "));
+    Serial.println(conflict);
+    return false;
+  }
+  config_apply();
+  return true;
+}
+
+const char *config_conflict(const void *block) {
+  // Each parameter is range checked on its own, these are the orderings
+  // between them that the fault, charge and derating code rely on
+  const bms_config *c = (const bms_config *)block;
+  if (!(c->vmin_code < c->charged_code &&
+        c->charged_code <= c->charge_stop_code &&
+        c->charge_stop_code <= c->charge_cv_code &&
+        c->charge_cv_code < c->vmax_code)) {
+    return "vmin < charged <= charge_stop <= cv < vmax";
+  }
+  if (c->uv_code >= c->ov_code) {
+    return "uv < ov";
+  }
+  if (c->temp_min >= c->temp_max) {
+    return "temp_min < temp_max";
+  }
+  if (c->charge_end_a >= c->charge_cc_a) {
+    return "end_a < charge_a";
+  }
+  if (!(c->charge_t_min < c->charge_t_cold &&
+        c->charge_t_cold <= c->charge_t_hot &&
+        c->charge_t_hot < c->charge_t_max)) {
+    return "chg_tmin < chg_tcold <= chg_thot < chg_tmax";
+  }
+  return NULL;
+}
+
+void config_apply() {
+  if (OV == cfg.ov_code && UV == cfg.uv_code) {
+    return;
+  }
+  OV = cfg.ov_code;
+  UV = cfg.uv_code;
+  for (uint8_t current_ic = 0; current_ic < TOTAL_IC; current_ic++) {
+    LTC6811_set_cfgr_ov(current_ic, BMS_IC, OV);
+    LTC6811_set_cfgr_uv(current_ic, BMS_IC, UV);
+  }
+  wakeup_idle(TOTAL_IC);
+  LTC6811_wrcfg(TOTAL_IC, BMS_IC);
+}
+
+void config_print() {
+  Serial.print(F("Config v"));
+  Serial.print(cfg.version);
+  Serial.print(F(", sequence "));
+  Serial.print(cfg.sequence);
+  Serial.print(F(", page "));
+  Serial.println(cfg_page);
+  for (uint8_t i = 0; i < sizeof(CONFIG_PARAMS) / sizeof(CONFIG_PARAMS[0]);
+       i++) {
+    const config_param *param = &CONFIG_PARAMS[i];
+    Serial.print(i);
+    Serial.print(" ");
+    Serial.print(param->name);
+    Serial.print(" = ");
+    switch (param->type) {
+      case CFG_U16:
+        Serial.println(*(uint16_t *)param->field);
+        break;
+      case CFG_I16:
+        Serial.println(*(int16_t *)param->field);
+        break;
+      case CFG_F32:
+        Serial.println(*(float *)param->field, 3);
+        break;
+    }
+  }
+  Serial.print(F("volt bypass:"));
+  for (int current_ic = 0; current_ic < TOTAL_IC; current_ic++) {
+    Serial.print(" ");
+    Serial.print(cfg.volt_bypass[current_ic], HEX);
+  }
+  Serial.print(F("\ntemp bypass:"));
+  for (int current_ic = 0; current_ic < TOTAL_IC; current_ic++) {
+    Serial.print(" ");
+    Serial.print(cfg.temp_bypass[current_ic], HEX);
+  }
+  Serial.print("\n");
+}
+
+uint32_t crc32(const uint8_t *data, uint32_t length) {
+  uint32_t crc = 0xFFFFFFFF;
+  while (length--) {
+    crc ^= *data++;
+    for (int bit = 0; bit < 8; bit++) {
+      crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+    }
+  }
+  return ~crc;
+}
+
+void cmd_log(uint8_t argc, char **argv) {
+  if (argc == 3 && strcmp(argv[1], "start") == 0) {
+    if (logging || !sd_ready()) {
+      Serial.println(F("Can't log now"));
+      return;
+    }
+    log_file = SD.open(argv[2], FILE_WRITE);
+    logging = log_file;
+    log_pending = 0;
+    Serial.println(logging ? F("Logging") : F("Can't open the log"));
+  } else if (argc == 2 && strcmp(argv[1], "stop") == 0 && logging) {
+    log_file.close();
+    logging = false;
+    Serial.println(F("Log closed"));
+  } else {
+    Serial.println(F("log start <file> | stop"));
+  }
+}
+
+bool sd_ready() {
+  if (!SD_READY) {
+    SD_READY = SD.begin(SD_CS_PIN);
+  }
+  return SD_READY;
+}
+
+void log_write() {
+  if (!logging || wcet_shed()) {
+    return;
+  }
+  log_frame frame;
+  log_frame *f = &frame;
+  f->magic = LOG_MAGIC;
+  f->total_ic = TOTAL_IC;
+  f->request = bms_in.request;
+  f->ms = millis();
+  for (int current_ic = 0; current_ic < TOTAL_IC; current_ic++) {
+    memcpy(f->cells[current_ic], BMS_IC[current_ic].cells.c_codes,
+           sizeof(f->cells[0]));
+    memcpy(f->aux[current_ic], BMS_IC[current_ic].aux.a_codes,
+           sizeof(f->aux[0]));
+    f->itmp[current_ic] = BMS_IC[current_ic].stat.stat_codes[1];
+    f->cell_stale[current_ic] = cell_stale[current_ic];
+    f->aux_stale[current_ic] = aux_stale[current_ic];
+  }
+  f->current_da = constrain(read_pack_current() * 10, -32768, 32767);
+  f->flags = manual_fault;
+  memset(f->reserved, 0, sizeof(f->reserved));
+  f->crc = crc32((const uint8_t *)f, offsetof(log_frame, crc));
+
+  if (log_file.write((const uint8_t *)f, sizeof(*f)) != sizeof(*f)) {
+    Serial.println(F("Log write failed, logging stopped"));
+    log_file.close();
+    logging = false;
+  } else if (++log_pending >= LOG_FLUSH_FRAMES) {
+    log_file.flush();
+    log_pending = 0;
+  }
+}
+
+void cmd_prof(uint8_t argc, char **argv) {
+  if (!PROFILE_LOOP) {
+    Serial.println(F("Profiling is off, see PROFILE_LOOP"));
+  } else if (argc == 2 && strcmp(argv[1], "reset") == 0) {
+    prof_reset();
+  } else {
+    prof_report();
+  }
+}
+
+void cmd_wcet(uint8_t argc, char **argv) {
+  if (argc == 2 && strcmp(argv[1], "reset") == 0) {
+    memset(wcet_overruns, 0, sizeof(wcet_overruns));
+    memset(wcet_worst, 0, sizeof(wcet_worst));
+    wcet_cycles = 0;
+    wcet_missed = 0;
+    wcet_cycle_worst = 0;
+  } else {
+    wcet_report();
+  }
+}
+
+void wcet_cycle() {
+  uint32_t us = (prof_now() - wcet_start) / CPU_MHZ;
+  wcet_cycles++;
+  wcet_cycle_worst = max(wcet_cycle_worst, us);
+  bool missed = us > CYCLE_DEADLINE_US;
+  wcet_missed += missed;
+
+  if (missed) {
+    wcet_in_row++;
+    wcet_clean = 0;
+    if (!wcet_shedding) {
+      Serial.println(F("Deadline missed, telemetry and logging shed"));
+    }
+    wcet_shedding = true;
+  } else {
+    wcet_in_row = 0;
+    if (wcet_shedding && ++wcet_clean >= SHED_RECOVER_CYCLES) {
+      wcet_shedding = false;
+      Serial.println(F("Back within deadline, telemetry restored"));
+    }
+  }
+  if (!missed) {
+    wdt_kick();
+  }
+}
+
+void wcet_report() {
+  Serial.println(F("stage: budget worst overruns (us)"));
+  for (int i = 0; i < PS_COUNT; i++) {
+    Serial.print(PROF_NAMES[i]);
+    Serial.print(": ");
+    Serial.print(WCET_BUDGET_US[i]);
+    Serial.print(" ");
+    Serial.print(wcet_worst[i]);
+    Serial.print(" ");
+    Serial.println(wcet_overruns[i]);
+  }
+  Serial.print(F("cycle: "));
+  Serial.print(CYCLE_DEADLINE_US);
+  Serial.print(" ");
+  Serial.print(wcet_cycle_worst);
+  Serial.print(" ");
+  Serial.print(wcet_missed);
+  Serial.print(F(" of "));
+  Serial.println(wcet_cycles);
+  Serial.print(F("Shedding "));
+  Serial.print(wcet_shedding ? F("on") : F("off"));
+  Serial.print(F(", missed in a row "));
+  Serial.print(wcet_in_row);
+  Serial.print(F(", last reset "));
+  Serial.println(reset_cause < 5 ? RESET_NAMES[reset_cause] : "unknown");
+}
+
+bool wcet_shed() {
+  return wcet_shedding || (prof_now() - wcet_start) / CPU_MHZ > CYCLE_SHED_US;
+}
+
+bool verbose_cycle() { return count % 4 == 0 && !wcet_shed(); }
+
+void wdt_kick() {
+  if (WATCHDOG) {
+    watchdogReset();
+  }
+}
+
+void reset_report() {
+#ifdef RSTC
+  reset_cause = (RSTC->RSTC_SR & RSTC_SR_RSTTYP_Msk) >> RSTC_SR_RSTTYP_Pos;
+  uint32_t crumb = GPBR->SYS_GPBR[0];  // only power on clears it
+  if (reset_cause != 0 && (crumb & 0xFFFF0000) == RESET_MAGIC &&
+      (crumb & 0xFFFF) < PS_COUNT) {
+    reset_stage = crumb & 0xFFFF;
+  }
+  GPBR->SYS_GPBR[0] = 0;
+  crumb = GPBR->SYS_GPBR[1];  // left alone until the fault is cleared
+  if (reset_cause == 2 && (crumb & 0xFFFF0000) == RESET_MAGIC) {
+    reset_fault = (int8_t)(crumb & 0xFF);
+  }
+#endif
+  Serial.print(F("Reset: "));
+  Serial.print(reset_cause < 5 ? RESET_NAMES[reset_cause] : "unknown");
+  if (reset_stage != PS_COUNT) {
+    Serial.print(F(", last stage done "));
+    Serial.print(PROF_NAMES[reset_stage]);
+  }
+  if (reset_fault != NO_FAULT) {
+    Serial.print(F(", fault "));
+    Serial.print(reset_fault);
+    Serial.print(F(" still latched"));
+  }
+  Serial.println();
+}
+
+void fault_crumb(int8_t fault) {
+#ifdef GPBR
+  GPBR->SYS_GPBR[1] = fault == NO_FAULT ? 0 : RESET_MAGIC | (uint8_t)fault;
+#endif
+}
+
+void prof_init() {
+#ifdef DWT
+  // The cycle counter runs only with trace enabled
+  CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+  DWT->CYCCNT = 0;
+  DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+#endif
+  prof_reset();
+}
+
+uint32_t prof_now() {
+#ifdef DWT
+  return DWT->CYCCNT;
+#else
+  return micros() * CPU_MHZ;  // host/ has no CMSIS, so no DWT either
+#endif
+}
+
+uint32_t prof_start() { return prof_now(); }
+
+void prof_end(uint8_t stage, uint32_t start) {
+  uint32_t cycles = prof_now() - start;
+  uint32_t us = cycles / CPU_MHZ;
+#ifdef GPBR
+  GPBR->SYS_GPBR[0] = RESET_MAGIC | stage;  // kept through a reset
+#endif
+  wcet_worst[stage] = max(wcet_worst[stage], us);
+  if (us > WCET_BUDGET_US[stage]) {
+    wcet_overruns[stage]++;
+  }
+  if (!PROFILE_LOOP) {
+    return;
+  }
+  prof_slot *p = &prof[stage];
+  p->n++;
+  p->sum += cycles;
+  p->min = min(p->min, cycles);
+  p->max = max(p->max, cycles);
+}
+
+void prof_reset() {
+  for (int i = 0; i < PS_COUNT; i++) {
+    prof[i].n = 0;
+    prof[i].min = UINT32_MAX;
+    prof[i].max = 0;
+    prof[i].sum = 0;
+  }
+}
+
+void prof_report() {
+  Serial.println(F("stage: n min avg max (us)"));
+  for (int i = 0; i < PS_COUNT; i++) {
+    prof_slot *p = &prof[i];
+    if (p->n == 0) {
+      continue;
+    }
+    Serial.print(PROF_NAMES[i]);
+    Serial.print(": ");
+    Serial.print(p->n);
+    Serial.print(" ");
+    Serial.print(p->min / CPU_MHZ);
+    Serial.print(" ");
+    Serial.print((uint32_t)(p->sum / p->n / CPU_MHZ));
+    Serial.print(" ");
+    Serial.println(p->max / CPU_MHZ);
+  }
+}
+
+void balance(double threshold) {
+  for (int current_ic = 0; current_ic < TOTAL_IC; current_ic++) {
+    dcc_cache[current_ic] = 0;
+    // No cell on this IC is far enough above the reference
+    if (stats.ic[current_ic].max * 0.0001 - consvmin[current_ic] <= threshold) {
+      continue;
+    }
+    const uint16_t *v = &pack.voltage[current_ic * CELLS_PER_IC];
+    // Bypassed, 0xFFFF or never read cells are never bled
+    uint16_t valid = pack.volt_valid[current_ic];
+    // Highest cells first, as many as the die temperature allows
+    float power = 0;
+    for (int n = 0; n < BMS_IC[0].ic_reg.cell_channels; n++) {
+      int top = -1;
+      for (int i = 0; i < BMS_IC[0].ic_reg.cell_channels; i++) {
+        if ((valid & (1 << i)) && !(dcc_cache[current_ic] & (1 << i)) &&
+            (v[i] * 0.0001 - consvmin[current_ic]) > threshold &&
+            (top < 0 || v[i] > v[top])) {
+          top = i;
+        }
+      }
+      if (top < 0) {
+        break;
+      }
+      float cell_power = pow(v[top] * 0.0001, 2) / BLEED_RESISTOR;
+      if (power + cell_power > bal_power[current_ic]) {
+        break;
+      }
+      power += cell_power;
+      dcc_cache[current_ic] |= (1 << top);
+    }
+  }
+  write_dcc(dcc_cache);
+}
+
+void balance_pwm(double threshold) {
+  // The duty of each cell comes from plan_balance(). The S pins only follow
+  // the PWM register once the LTC6811 watchdog has expired. In BALANCE_ONLY
+  // each plan goes out once, one wrcfg with the DCC bit of every cell that
+  // bleeds and one wrpwm with the duties, and pwm_quiet() then leaves the
+  // chain alone for PWM_WINDOW_MS. Driving or charging, the chain is read
+  // every cycle and the watchdog never expires, so there the same duty goes
+  // out as a PWM_STEPS-cycle frame of DCC bits, one wrcfg per cycle.
+  bool window = state == ST_BALANCE;
+  if (window || count % PWM_UPDATE_CYCLES == 0) {
+    plan_balance(threshold);
+  }
+  if (verbose_cycle()) {
+    Serial.print("Balance ETA: ");
+    Serial.print(bal_eta_h * 60, 1);
+    Serial.println(" min");
+  }
+  if (window) {
+    for (int current_ic = 0; current_ic < TOTAL_IC; current_ic++) {
+      uint16_t dcc = 0;
+      for (int i = 0; i < CELLS_PER_IC; i++) {
+        dcc |= (pwm_duty[current_ic][i] > 0) << i;
+      }
+      dcc_cache[current_ic] = dcc;
+    }
+    write_dcc(dcc_cache);
+    write_pwm();
+    pwm_window = true;
+    pwm_window_ms = millis();
+    pwm_window_us = micros();
+    return;
+  }
+
+  uint8_t slot = count % PWM_STEPS;
+  for (int current_ic = 0; current_ic < TOTAL_IC; current_ic++) {
+    uint16_t dcc = 0;
+    for (int i = 0; i < CELLS_PER_IC; i++) {
+      dcc |= (pwm_duty[current_ic][i] > slot) << i;
+    }
+    dcc_cache[current_ic] = dcc;
+  }
+  write_dcc(dcc_cache);
+}
+
+void die_temp_detect() {
+  int8_t error = 0;
+
+  wakeup_idle(TOTAL_IC);
+  LTC6811_adstat(ADC_CONVERSION_MODE, STAT_CH_ITEMP);
+  LTC6811_pollAdc();
+  wakeup_idle(TOTAL_IC);
+  error = LTC6811_rdstat(SEL_ALL_REG, TOTAL_IC, BMS_IC);
+  check_error(error);
+
+  for (int current_ic = 0; current_ic < TOTAL_IC; current_ic++) {
+    st *stat = &BMS_IC[current_ic].stat;
+    if (stat->pec_match[0] || stat->pec_match[1]) {
+      continue;  // keep the last budget, the next read will decide
+    }
+    // ITMP: 7.5mV/K, 100uV per LSB
+    die_temp[current_ic] = stat->stat_codes[1] * 0.0001 / 0.0075 - 273;
+
+    if (stat->thsd[0]) {
+      bal_power[current_ic] = 0;
+    } else if (die_temp[current_ic] > DIE_TEMP_LIMIT) {
+      bal_power[current_ic] /= 2;
+    } else if (die_temp[current_ic] < DIE_TEMP_LIMIT - DIE_TEMP_HYST) {
+      bal_power[current_ic] =
+          min(bal_power[current_ic] + BAL_POWER_STEP, BAL_POWER_LIMIT);
+    }
+  }
+
+  if (verbose_cycle()) {
+    Serial.print("Die temp: ");
+    for (int current_ic = 0; current_ic < TOTAL_IC; current_ic++) {
+      Serial.print(die_temp[current_ic], 1);
+      Serial.print(BMS_IC[current_ic].stat.thsd[0] ? "(THSD), " : ", ");
+    }
+    Serial.print("\n");
+  }
+}
+
+void write_dcc(const uint16_t *dcc) {
+  // Unchanged bits are written again now and then to restart the discharge
+  // timer before DCTO clears them
+  bool changed = millis() - dcc_written_ms >= DCC_REFRESH_MS;
+  for (int current_ic = 0; current_ic < TOTAL_IC; current_ic++) {
+    changed |= (dcc[current_ic] != dcc_live[current_ic]);
+  }
+  if (!changed) {
+    return;
+  }
+
+  dcc_account(0);
+  for (int current_ic = 0; current_ic < TOTAL_IC; current_ic++) {
+    BMS_IC[current_ic].config.tx_data[4] = dcc[current_ic] & 0xFF;
+    BMS_IC[current_ic].config.tx_data[5] =
+        (BMS_IC[current_ic].config.tx_data[5] & 0xF0) | (dcc[current_ic] >> 8);
+    dcc_live[current_ic] = dcc[current_ic];
+  }
+  wakeup_idle(TOTAL_IC);
+  LTC6811_wrcfg(TOTAL_IC, BMS_IC);
+  dcc_written_ms = millis();
+  dcc_writes++;
+}
+
+bool pwm_quiet() {
+  // Between two plans in BALANCE_ONLY nothing goes to the chain, so the
+  // LTC6811 watchdog expires after LTC_WATCHDOG_MS and the S pins follow
+  // the PWM register. A new request, a clear or a manual fault ends the
+  // window early. The window is kept a few seconds longer than the
+  // watchdog, so the cells and temperatures are still read every few
+  // seconds while they bleed. The watchdog reset all of CFGR but DCC and
+  // DCTO, so it is written back before the cells are read again.
+  if (!pwm_window) {
+    return false;
+  }
+  if (millis() - pwm_window_ms < PWM_WINDOW_MS && state == ST_BALANCE &&
+      bms_in.request == REQ_BALANCE && !bms_in.clear_fault && !manual_fault) {
+    return true;
+  }
+  dcc_account(0);
+  pwm_window = false;
+  wakeup_sleep(TOTAL_IC);
+  LTC6811_wrcfg(TOTAL_IC, BMS_IC);
+  dcc_written_ms = millis();
+  dcc_writes++;
+  return false;
+}
+
+void dcc_account(uint32_t muted_us) {
+  uint32_t now = micros();
+  uint32_t elapsed = now - dcc_stamp;
+  if (muted_us > elapsed) {
+    muted_us = elapsed;
+  }
+  // In a PWM window the S pins follow DCC until the LTC6811 watchdog
+  // expires and the PWM register after that
+  uint32_t on_us = elapsed - muted_us;
+  uint32_t pwm_us = 0;
+  uint32_t since = now - pwm_window_us;
+  if (pwm_window && since > LTC_WATCHDOG_MS * 1000UL) {
+    pwm_us = min(since - LTC_WATCHDOG_MS * 1000UL, on_us);
+  }
+  for (int current_ic = 0; current_ic < TOTAL_IC; current_ic++) {
+    for (int i = 0; i < CELLS_PER_IC; i++) {
+      if (dcc_live[current_ic] & (1 << i)) {
+        dcc_on_us += on_us - pwm_us +
+                     (uint64_t)pwm_us * pwm_duty[current_ic][i] / PWM_STEPS;
+      }
+    }
+  }
+  dcc_wall_us += elapsed;
+  dcc_stamp = now;
+}
+
+void print_duty() {
+  dcc_account(0);
+  float seconds = dcc_wall_us * 1e-6;
+  if (seconds > 0) {
+    Serial.print("Bleed delivered: ");
+    Serial.print(dcc_on_us * 1e-6 / seconds, 3);
+    Serial.print(" cell-s/s, ");
+    Serial.print(dcc_writes / seconds, 2);
+    Serial.print(" wrcfg/s over ");
+    Serial.print(seconds, 1);
+    Serial.println(" s");
+  }
+  dcc_on_us = 0;
+  dcc_wall_us = 0;
+  dcc_writes = 0;
+}
+
+bool plan_balance(double threshold) {
+  // Cell i needs t_i hours at full duty to bleed its excess charge. With a
+  // duty d_i = t_i / T every cell on the IC finishes together after T hours,
+  // and the shortest T that keeps d_i <= 1 and the bleed power under
+  // bal_power is T = max(max t_i, sum(t_i * p_i) / bal_power).
+  bool changed = false;
+  float eta = 0;
+
+  for (int current_ic = 0; current_ic < TOTAL_IC; current_ic++) {
+    const uint16_t *v = &pack.voltage[current_ic * CELLS_PER_IC];
+    float floor_soc = soc_from_code(consvmin[current_ic] * 10000);
+    float hours[CELLS_PER_IC];
+    float longest = 0;
+    float energy = 0;  // Wh bled at full duty
+
+    for (int i = 0; i < CELLS_PER_IC; i++) {
+      hours[i] = 0;
+      if (bal_power[current_ic] <= 0 ||  // thermal shutdown, no bleeding
+          (cfg.volt_bypass[current_ic] & (1 << i)) ||
+          v[i] * 0.0001 - consvmin[current_ic] <= threshold) {
+        continue;
+      }
+      float amps = v[i] * 0.0001 / BLEED_RESISTOR;
+      float ah = CELL_CAPACITY_AH * (soc_from_code(v[i]) - floor_soc);
+      hours[i] = ah > 0 ? ah / amps : 0;
+      longest = max(longest, hours[i]);
+      energy += hours[i] * amps * v[i] * 0.0001;
+    }
+
+    float horizon = energy > 0 ? max(longest, energy / bal_power[current_ic])
+                               : longest;
+    for (int i = 0; i < CELLS_PER_IC; i++) {
+      uint8_t duty = 0;
+      if (hours[i] > 0) {  // round down to stay inside the power budget
+        duty = constrain((int)(hours[i] / horizon * PWM_STEPS), 1, PWM_STEPS);
+      }
+      changed |= (duty != pwm_duty[current_ic][i]);
+      pwm_duty[current_ic][i] = duty;
+    }
+    eta = max(eta, horizon);
+  }
+  bal_eta_h = eta;
+  return changed;
+}
+
+float soc_from_code(uint16_t code) {
+  if (code <= OCV_TABLE[0]) {
+    return 0;
+  }
+  for (int i = 1; i < 11; i++) {
+    if (code < OCV_TABLE[i]) {
+      return (i - 1 + (float)(code - OCV_TABLE[i - 1]) /
+                          (OCV_TABLE[i] - OCV_TABLE[i - 1])) *
+             0.1;
+    }
+  }
+  return 1;
+}
+
+void write_pwm() {
+  for (int current_ic = 0; current_ic < TOTAL_IC; current_ic++) {
+    for (int j = 0; j < 6; j++) {  // two 4-bit duties per byte
+      BMS_IC[current_ic].pwm.tx_data[j] =
+          pwm_duty[current_ic][2 * j] | (pwm_duty[current_ic][2 * j + 1] << 4);
+    }
+  }
+  wakeup_idle(TOTAL_IC);
+  LTC6811_wrpwm(TOTAL_IC, 0, BMS_IC);
+}
+
+void set_ic_discharge(
+    int Cell,            // The cell to be discharged
+    uint8_t current_ic,  // The subsystem of the selected IC to be discharge
+    cell_asic *ic        // A two dimensional array that will store the data
+) {
+  if ((Cell < 9) && (Cell != 0)) {
+    ic[current_ic].config.tx_data[4] =
+        ic[current_ic].config.tx_data[4] | (1 << (Cell - 1));
+  } else if (Cell < 13) {
+    ic[current_ic].config.tx_data[5] =
+        ic[current_ic].config.tx_data[5] | (1 << (Cell - 9));
+  }
+}
+
+void stop_ic_discharge(
+    int Cell,            // The cell to stop discharging
+    uint8_t current_ic,  // The subsystem of the selected IC to discharging
+    cell_asic *ic        // A two dimensional array that will store the data
+) {
+  switch (Cell) {
+    case 1:
+      ic[current_ic].config.tx_data[4] =
+          ic[current_ic].config.tx_data[4] & (0xFE);
+      break;
+    case 2:
+      ic[current_ic].config.tx_data[4] =
+          ic[current_ic].config.tx_data[4] & (0xFD);
+      break;
+    case 3:
+      ic[current_ic].config.tx_data[4] =
+          ic[current_ic].config.tx_data[4] & (0xFB);
+      break;
+    case 4:
+      ic[current_ic].config.tx_data[4] =
+          ic[current_ic].config.tx_data[4] & (0xF7);
+      break;
+    case 5:
+      ic[current_ic].config.tx_data[4] =
+          ic[current_ic].config.tx_data[4] & (0xEF);
+      break;
+    case 6:
+      ic[current_ic].config.tx_data[4] =
+          ic[current_ic].config.tx_data[4] & (0xDF);
+      break;
+    case 7:
+      ic[current_ic].config.tx_data[4] =
+          ic[current_ic].config.tx_data[4] & (0xBF);
+      break;
+    case 8:
+      ic[current_ic].config.tx_data[4] =
+          ic[current_ic].config.tx_data[4] & (0x7F);
+      break;
+    case 9:
+      ic[current_ic].config.tx_data[5] =
+          ic[current_ic].config.tx_data[5] & (0xFE);
+      break;
+    case 10:
+      ic[current_ic].config.tx_data[5] =
+          ic[current_ic].config.tx_data[5] & (0xFD);
+      break;
+    case 11:
+      ic[current_ic].config.tx_data[5] =
+          ic[current_ic].config.tx_data[5] & (0xFB);
+      break;
+    case 12:
+      ic[current_ic].config.tx_data[5] =
+          ic[current_ic].config.tx_data[5] & (0xF7);
+      break;
+    default:
+      break;
+  }
+}
+
+void calculate() {  // calculate minimal and maxium
+  uint64_t sum_sq = 0;
+
+  stats.min = 0xFFFF;
+  stats.max = 0;
+  stats.sum = 0;
+  stats.n = 0;
+  stats.n_charged = 0;
+  for (int current_ic = 0; current_ic < TOTAL_IC; current_ic++) {
+    const uint16_t *v = &pack.voltage[current_ic * CELLS_PER_IC];
+    ic_stats *s = &stats.ic[current_ic];
+    s->min = 50000;  // 5 V, so an IC with every cell bypassed never faults
+    s->max = 0;
+    s->min_cell = 0;
+    s->max_cell = 0;
+    s->sum = 0;
+    s->n = 0;
+    uint16_t charged = 0;
+    for (int i = 0; i < CELLS_PER_IC; i++) {
+      // Bypassed, 0xFFFF or never read, kept out of every statistic
+      if (!(pack.volt_valid[current_ic] & (1 << i))) {
+        continue;
+      }
+      if (v[i] < s->min) {
+        s->min = v[i];
+        s->min_cell = i;
+      }
+      if (v[i] > s->max) {
+        s->max = v[i];
+        s->max_cell = i;
+      }
+      charged |= (v[i] >= cfg.charged_code) << i;
+      s->sum += v[i];
+      s->n++;
+      sum_sq += (uint32_t)v[i] * v[i];
+    }
+
+    if (s->min < stats.min) {
+      stats.min = s->min;
+      stats.min_ic = current_ic;
+      stats.min_cell = s->min_cell;
+    }
+    if (s->max > stats.max) {
+      stats.max = s->max;
+      stats.max_ic = current_ic;
+      stats.max_cell = s->max_cell;
+    }
+    stats.sum += s->sum;
+    stats.n += s->n;
+    charge_finish[current_ic] = charged;
+    stats.n_charged += __builtin_popcount(charged);
+  }
+
+  if (stats.n > 0) {
+    double mean = (double)stats.sum / stats.n;
+    double var = (double)sum_sq / stats.n - mean * mean;
+    stats.mean = mean * 0.0001;
+    stats.stdev = var > 0 ? sqrt(var) * 0.0001 : 0;
+  } else {
+    stats.mean = 0;
+    stats.stdev = 0;
+  }
+}
+
+void reset_vmin() {
+  for (int i = 0; i < TOTAL_IC; i++) {
+    consvmin[i] = stats.ic[i].min * 0.0001;  // Set up a costant Vminimum in
+                                             // case of the minumum become
+                                             // lower and lower
+  }
+}
+
+void select(int ic, int cell) {
+  int8_t error = 0;
+  wakeup_sleep(TOTAL_IC);
+  dcc_cache[ic] |= (1 << (cell - 1));
+  write_dcc(dcc_cache);
+  error = LTC6811_rdcfg(TOTAL_IC, BMS_IC);
+  check_error(error);  // Check error to enable the function
+  wakeup_idle(TOTAL_IC);
+}
+
+void charge_detect() {
+  for (int i = 0; i < TOTAL_IC; i++) {
+    if (stats.ic[i].max < cfg.charge_stop_code) {
+      continue;
+    }
+    for (int j = 0; j < CELLS_PER_IC; j++) {
+      if ((pack.volt_valid[i] & (1 << j)) &&
+          pack.voltage[i * CELLS_PER_IC + j] >= cfg.charge_stop_code) {
+        dcc_cache[i] |= (1 << j);
+      }
+    }
+  }
+  write_dcc(dcc_cache);
+}
+
+void temp_detect() {
+  uint32_t conv_time = 0;
+  int8_t error = 0;
+
+  uint32_t t = prof_start();
+  wakeup_sleep(TOTAL_IC);
+  LTC6811_adax(ADC_CONVERSION_MODE, AUX_CH_TO_CONVERT);
+  conv_time = LTC6811_pollAdc();
+  error = read_aux_checked();  // read back all aux registers
+  if (conv_time >= POLL_TIMEOUT) {
+    for (int current_ic = 0; current_ic < TOTAL_IC; current_ic++) {
+      aux_stale[current_ic] = 0x3F;  // GPIO1..5 and REF2
+    }
+    error = -1;
+  }
+  check_error(error);
+  prof_end(PS_AUX, t);
+  idle_wait(100);
+
+  const float THSourceVoltage = 3.0;
+  const int THRES = 10000;
+  const float RT0 = 10000;  // The NTC resistance during 25 deg C
+  const float RT1 = 32650;  // The NTC resistance during 0 deg C
+  const float RT2 = 588.6;  // The NTC resistance during 100 deg C
+  const float T0 = 298.15;  // The Kelvin during 25 deg C
+  const float T1 = 273.15;  // The Kelvin during 0 deg C
+  const float T2 = 378.15;  // The Kelvin during 105 deg C
+
+  for (int current_ic = 0; current_ic < TOTAL_IC; current_ic++) {
+    for (int i = 0; i < 5; i++) {
+      // GPIO->V
+      // 10V/(5-V)= R = 10*exp(3984*(1/T-1/298.15))
+      // Rt = R*EXP(B*(1/T1-1/T2))
+      if (BMS_IC[current_ic].aux.a_codes[i] != 0) {
+        float VoltageOut;
+        float ROut;
+        float beta;
+        float Rx;
+        uint32_t KelvinValue;
+
+        beta = (log(RT1 / RT2)) / ((1 / T1) - (1 / T2));
+        Rx = RT0 * exp(-beta / T0);
+
+        VoltageOut = BMS_IC[current_ic].aux.a_codes[i] * 0.0001;
+
+        ROut = THRES * VoltageOut /
+               (THSourceVoltage - VoltageOut);  // current NTC resistance
+        KelvinValue = (beta / log(ROut / Rx));
+
+        pack.temp[current_ic * TEMPS_PER_IC + i] =
+            KelvinValue - 273.15;  // Kelvin to deg C
+      }
+    }
+
+    uint16_t read = 0;
+    uint16_t high = 0;
+    uint16_t low = 0;
+    const int16_t *t = &pack.temp[current_ic * TEMPS_PER_IC];
+    for (int i = 0; i < TEMPS_PER_IC; i++) {
+      // GPIO1..3 are aux group 1, GPIO4..5 group 2
+      bool ok = BMS_IC[current_ic].aux.a_codes[i] != 0 &&
+                (aux_groups_read[current_ic] & (1 << (i / 3)));
+      read |= ok << i;
+      high |= (ok && t[i] > cfg.temp_max) << i;
+      low |= (ok && t[i] <= cfg.temp_min) << i;
+    }
+    pack.temp_valid[current_ic] = read & ~cfg.temp_bypass[current_ic];
+    temp_high[current_ic] = high;
+    temp_low[current_ic] = low;
+  }
+
+  if (verbose_cycle()) {
+    for (int current_ic = 0; current_ic < TOTAL_IC; current_ic++) {
+      Serial.print(" IC ");
+      Serial.print(current_ic + 1, DEC);
+      Serial.print(": ");
+      for (int i = 0; i < TEMPS_PER_IC; i++) {
+        Serial.print(pack.temp[current_ic * TEMPS_PER_IC + i]);
+        Serial.print(", ");
+      }
+      Serial.print("\n");
+    }
+    Serial.print("\n");
+  }
+
+  error_temp();
+}
+
+void error_temp() {
+  for (int current_ic = 0; current_ic < TOTAL_IC; current_ic++) {
+    uint16_t high = temp_high[current_ic] & ~cfg.temp_bypass[current_ic];
+    uint16_t low = temp_low[current_ic] & ~cfg.temp_bypass[current_ic];
+    if ((high | low) == 0) {
+      continue;
+    }
+    for (int i = 0; i < TEMPS_PER_IC; i++) {
+      if (high & (1 << i)) {
         Serial.print("[");
         Serial.print(current_ic + 1, DEC);
         Serial.print("]");
@@ -616,18 +2870,27 @@ void error_temp() {
         Serial.print(i);
         Serial.print("]");
 
-        status = FAULT;
-        write_fault(2);
+        raise_fault(1);
+      }
+      if (low & (1 << i)) {
+        Serial.print("[");
+        Serial.print(current_ic + 1, DEC);
+        Serial.print("]");
+        Serial.print("[");
+        Serial.print(i);
+        Serial.print("]");
+
+        raise_fault(2);
       }
     }
   }
-  if (count % 4 == 0) {
+  if (verbose_cycle()) {
     Serial.print("\n");
   }
 }
 
 void write_fault(int reason) {
-  if (count % 4 == 0) {
+  if (verbose_cycle()) {
     switch (reason) {
       case 0:
         Serial.println(F(": *********** Voltage out of Range ***********"));
@@ -644,8 +2907,243 @@ void write_fault(int reason) {
       case 4:
         Serial.println(F(": ************* Other reasons *************"));
         break;
+      case 5:
+        Serial.println(F(": ********** Stale data (PEC error) **********"));
+        break;
+      case 6:
+        Serial.println(F(": *********** Loop over its deadline ***********"));
+        break;
+    }
+  }
+}
+
+void spi_sweep() {
+  for (uint8_t level = 0; level < SPI_LEVELS; level++) {
+    spi_enable(SPI_DIV_LADDER[level]);
+    LTC6811_reset_crc_count(TOTAL_IC, BMS_IC);
+    wakeup_sleep(TOTAL_IC);
+    LTC6811_wrcfg(TOTAL_IC, BMS_IC);
+    for (int i = 0; i < SPI_SWEEP_TRIALS; i++) {
+      wakeup_idle(TOTAL_IC);
+      LTC6811_rdcfg(TOTAL_IC, BMS_IC);
+      LTC6811_adcv(ADC_CONVERSION_MODE, ADC_DCP, CELL_CH_TO_CONVERT);
+      LTC6811_pollAdc();
+      wakeup_idle(TOTAL_IC);
+      LTC6811_rdcv(SEL_ALL_REG, TOTAL_IC, BMS_IC);
+    }
+    spi_ceiling = level;
+    if (pec_total() == 0) {  // zero error budget while sweeping
+      break;
+    }
+  }
+
+  spi_level = spi_ceiling;
+  LTC6811_reset_crc_count(TOTAL_IC, BMS_IC);
+  spi_last_pec = 0;
+  spi_clean_cycles = 0;
+  Serial.print("SPI divider: ");
+  Serial.println(SPI_DIV_LADDER[spi_level]);
+}
+
+void spi_link_monitor() {  // called once per check_stat() cycle
+  uint32_t pec = pec_total();
+  uint32_t errors = pec - spi_last_pec;
+  spi_last_pec = pec;
+
+  if (errors >= SPI_PEC_BUDGET && spi_level < SPI_LEVELS - 1) {
+    spi_level++;
+    spi_clean_cycles = 0;
+  } else if (errors == 0 && spi_level > spi_ceiling &&
+             ++spi_clean_cycles >= SPI_RECOVER_CYCLES) {
+    spi_level--;
+    spi_clean_cycles = 0;
+  } else {
+    if (errors != 0) {
+      spi_clean_cycles = 0;
+    }
+    return;
+  }
+
+  spi_enable(SPI_DIV_LADDER[spi_level]);
+  Serial.print("SPI divider changed: ");
+  Serial.println(SPI_DIV_LADDER[spi_level]);
+}
+
+uint32_t pec_total() {
+  uint32_t total = 0;
+  for (int current_ic = 0; current_ic < TOTAL_IC; current_ic++) {
+    total += BMS_IC[current_ic].crc_count.pec_count;
+  }
+  return total;
+}
+
+int8_t read_cells_checked() {
+  LTC6811_rdcv(SEL_ALL_REG, TOTAL_IC, BMS_IC);
+  return recover_groups(CELL);
+}
+
+int8_t read_aux_checked() {
+  LTC6811_rdaux(SEL_ALL_REG, TOTAL_IC, BMS_IC);
+  return recover_groups(AUX);
+}
+
+int8_t recover_groups(uint8_t type) {
+  // Only the groups that failed are re-issued, and only the ICs that failed
+  // take the re-read codes. The ICs that were fine keep their first read.
+  // LTC681x_rdcv(reg != 0) is not used because it offsets the buffer twice.
+  const uint8_t CODES_IN_REG = 3;
+  uint8_t num_reg = (type == CELL) ? BMS_IC[0].ic_reg.num_cv_reg
+                                   : BMS_IC[0].ic_reg.num_gpio_reg;
+  uint8_t data[NUM_RX_BYT * TOTAL_IC];
+  uint16_t codes[18];
+  uint8_t pec[6];
+  int8_t error = 0;
+
+  for (int current_ic = 0; current_ic < TOTAL_IC; current_ic++) {
+    if (type == CELL) {
+      cell_stale[current_ic] = 0;
+    } else {
+      aux_stale[current_ic] = 0;
+    }
+  }
+
+  for (uint8_t reg = 1; reg <= num_reg; reg++) {
+    for (int retry = 0; retry < READ_RETRIES; retry++) {
+      bool failed = false;
+      for (int current_ic = 0; current_ic < TOTAL_IC; current_ic++) {
+        uint8_t *match = (type == CELL) ? BMS_IC[current_ic].cells.pec_match
+                                        : BMS_IC[current_ic].aux.pec_match;
+        failed |= match[reg - 1];
+      }
+      if (!failed) {
+        break;
+      }
+
+      wakeup_idle(TOTAL_IC);
+      type == CELL ? LTC681x_rdcv_reg(reg, TOTAL_IC, data)
+                   : LTC681x_rdaux_reg(reg, TOTAL_IC, data);
+      for (int current_ic = 0; current_ic < TOTAL_IC; current_ic++) {
+        cell_asic *ic = &BMS_IC[current_ic];
+        uint8_t *match =
+            (type == CELL) ? ic->cells.pec_match : ic->aux.pec_match;
+        uint16_t *dest = (type == CELL) ? ic->cells.c_codes : ic->aux.a_codes;
+        if (match[reg - 1] == 0) {
+          continue;
+        }
+        if (parse_cells(current_ic, reg, data, codes, pec) == 0) {
+          for (int i = 0; i < CODES_IN_REG; i++) {
+            dest[(reg - 1) * CODES_IN_REG + i] =
+                codes[(reg - 1) * CODES_IN_REG + i];
+          }
+          match[reg - 1] = 0;
+        } else {  // keep the counters honest for spi_link_monitor()
+          ic->crc_count.pec_count++;
+          type == CELL ? ic->crc_count.cell_pec[reg - 1]++
+                       : ic->crc_count.aux_pec[reg - 1]++;
+        }
+      }
+    }
+
+    // Whatever still fails is replaced by the last good codes.
+    for (int current_ic = 0; current_ic < TOTAL_IC; current_ic++) {
+      cell_asic *ic = &BMS_IC[current_ic];
+      uint8_t *read = (type == CELL) ? &cell_groups_read[current_ic]
+                                     : &aux_groups_read[current_ic];
+      uint8_t *match =
+          (type == CELL) ? ic->cells.pec_match : ic->aux.pec_match;
+      *read |= match[reg - 1] ? 0 : (1 << (reg - 1));
+      bool unread = !(*read & (1 << (reg - 1)));
+      for (int i = 0; i < CODES_IN_REG; i++) {
+        int ch = (reg - 1) * CODES_IN_REG + i;
+        if (type == CELL && ic->cells.pec_match[reg - 1]) {
+          ic->cells.c_codes[ch] = good_cells[current_ic][ch];
+          cell_stale[current_ic] |= (1 << ch);
+          error = -1;
+        } else if (type == CELL) {
+          good_cells[current_ic][ch] = ic->cells.c_codes[ch];
+        }
+
+        if (type == CELL) {
+          uint16_t code = ic->cells.c_codes[ch];
+          pack.voltage[current_ic * CELLS_PER_IC + ch] = code;
+          if (code != 0xFFFF && !unread &&
+              !(cfg.volt_bypass[current_ic] & (1 << ch))) {
+            pack.volt_valid[current_ic] |= (1 << ch);
+          } else {
+            pack.volt_valid[current_ic] &= ~(1 << ch);
+          }
+        } else if (ic->aux.pec_match[reg - 1]) {
+          ic->aux.a_codes[ch] = good_aux[current_ic][ch];
+          aux_stale[current_ic] |= (1 << ch);
+          error = -1;
+        } else {
+          good_aux[current_ic][ch] = ic->aux.a_codes[ch];
+        }
+      }
+    }
+  }
+  return error;
+}
+
+void stale_detect() {
+  const uint8_t ALL_CELL_GROUPS = (1 << BMS_IC[0].ic_reg.num_cv_reg) - 1;
+  const uint8_t ALL_AUX_GROUPS = (1 << BMS_IC[0].ic_reg.num_gpio_reg) - 1;
+  for (int current_ic = 0; current_ic < TOTAL_IC; current_ic++) {
+    // A group that never passed PEC has no last good codes to run on
+    bool unread = cell_groups_read[current_ic] != ALL_CELL_GROUPS ||
+                  aux_groups_read[current_ic] != ALL_AUX_GROUPS;
+    if (cell_stale[current_ic] == 0 && aux_stale[current_ic] == 0) {
+      stale_cycles[current_ic] = 0;
+    } else if (++stale_cycles[current_ic] >= STALE_LIMIT || unread) {
+      stale_cycles[current_ic] = min(stale_cycles[current_ic], STALE_LIMIT);
+      Serial.print("[");
+      Serial.print(current_ic + 1, DEC);
+      Serial.print("]");
+
+      raise_fault(5);
+    }
+  }
+}
+
+void bench_pack() {
+  uint32_t start;
+  uint32_t aos_time;
+  uint32_t soa_time;
+  volatile double sink = 0;  // keeps the compiler from dropping the scan
+
+  start = micros();
+  for (int n = 0; n < BENCH_ROUNDS; n++) {
+    double lo = 5;
+    double hi = 0;
+    double sum = 0;
+    for (int current_ic = 0; current_ic < TOTAL_IC; current_ic++) {
+      for (int i = 0; i < BMS_IC[0].ic_reg.cell_channels; i++) {
+        if (!(cfg.volt_bypass[current_ic] & (1 << i))) {
+          double v = BMS_IC[current_ic].cells.c_codes[i] * 0.0001;
+          lo > v ? lo = v : 1;
+          hi < v ? hi = v : 1;
+          sum += v;
+        }
+      }
     }
+    sink = lo + hi + sum;
+  }
+  aos_time = micros() - start;
+
+  start = micros();
+  for (int n = 0; n < BENCH_ROUNDS; n++) {
+    calculate();
+    sink = stats.min + stats.max + stats.sum;
   }
+  soa_time = micros() - start;
+  (void)sink;
+
+  Serial.print("cell_asic scan: ");
+  Serial.print(aos_time / (float)BENCH_ROUNDS, 2);
+  Serial.println(" us");
+  Serial.print("calculate():    ");
+  Serial.print(soa_time / (float)BENCH_ROUNDS, 2);
+  Serial.println(" us");
 }
 
 // if (SD_READY) {
@@ -659,4 +3157,4 @@ void write_fault(int reason) {
 //     // if the file didn't open, print an error:
 //     Serial.println("error opening Fault_record.txt");
 //   }
-// }
\ No newline at end of file
+// }
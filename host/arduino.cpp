@@ -0,0 +1,346 @@
+// Due core, libsam and LT_SPI for the host build, see include/Arduino.h
+#include <Arduino.h>
+#include <DueTimer.h>
+#include <SD.h>
+#include <SPI.h>
+#include <stdarg.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "LT_SPI.h"
+#include "host.h"
+
+HardwareSerial Serial;
+SPIClass SPI;
+SDClass SD;
+DueTimer Timer0;
+Can host_can0;
+Efc host_efc1;
+Rstc host_rstc;
+Gpbr host_gpbr;
+uint32_t SystemCoreClock = 84000000;
+uint8_t host_iflash1[IFLASH1_PAGE_SIZE * IFLASH1_NB_OF_PAGES];
+int host_failures = 0;
+
+namespace {
+
+std::string output;
+bool echo = false;
+std::deque<char> console_in;
+uint8_t pins[NUM_DIGITAL_PINS];
+uint32_t pin_ms[NUM_DIGITAL_PINS];  // millis() of the last change of level
+int analog[NUM_DIGITAL_PINS];
+uint32_t cycles = 0;
+
+// CAN mailboxes, sent frames are done at once and received ones wait in
+// pending until a receive mailbox with a matching filter takes them
+const uint8_t CAN_MBS = 8;
+can_mb_conf_t mailboxes[CAN_MBS];
+std::vector<host_can_frame> sent;
+std::deque<host_can_frame> pending;
+
+uint64_t now_us() {
+  timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000ULL + t.tv_nsec / 1000;
+}
+const uint64_t start_us = now_us();
+int64_t skipped_us = 0;  // waits of the sketch, see host_skip()
+bool held = false;
+uint64_t held_us = 0;  // real part of the clock when it was held
+void (*tick)() = NULL;
+bool ticking = false;
+uint32_t wdt_timeout_ms = 0;  // 0: disabled
+uint32_t wdt_kick_ms = 0;
+uint32_t wdt_expired = 0;
+
+uint64_t clock_us() {
+  return (held ? held_us : now_us() - start_us) + skipped_us;
+}
+
+void wdt_check() {
+  if (wdt_timeout_ms != 0 && millis() - wdt_kick_ms > wdt_timeout_ms) {
+    wdt_expired++;
+    host_printf("Watchdog expired, the Due would reset here\n");
+    wdt_kick_ms = millis();  // count the next expiry from here
+  }
+}
+
+bool can_match(const can_mb_conf_t &mb, const host_can_frame &frame) {
+  if (mb.uc_obj_type != CAN_MB_RX_MODE || mb.uc_id_ver != frame.ext) {
+    return false;
+  }
+  uint32_t id = frame.ext ? frame.id : CAN_MID_MIDvA(frame.id);
+  return ((id ^ mb.ul_id) & mb.ul_id_msk) == 0;
+}
+
+}  // namespace
+
+size_t Print::printf_(const char *format, ...) {
+  char buf[64];
+  va_list args;
+  va_start(args, format);
+  int n = vsnprintf(buf, sizeof(buf), format, args);
+  va_end(args);
+  return write((const uint8_t *)buf, min(n, (int)sizeof(buf) - 1));
+}
+
+int HardwareSerial::available() { return console_in.size(); }
+
+int HardwareSerial::read() {
+  if (console_in.empty()) {
+    return -1;
+  }
+  char c = console_in.front();
+  console_in.pop_front();
+  return (uint8_t)c;
+}
+
+int HardwareSerial::peek() {
+  return console_in.empty() ? -1 : (uint8_t)console_in.front();
+}
+
+size_t HardwareSerial::write(uint8_t c) {
+  output += (char)c;
+  if (echo) {
+    fputc(c, stdout);
+  }
+  return 1;
+}
+
+size_t HardwareSerial::readBytes(char *buf, size_t n) {
+  size_t i = 0;
+  for (; i < n && !console_in.empty(); i++) {
+    buf[i] = read();
+  }
+  return i;
+}
+
+int File::available() {
+  if (!f_) {
+    return 0;
+  }
+  long at = ftell(f_);
+  fseek(f_, 0, SEEK_END);
+  long end = ftell(f_);
+  fseek(f_, at, SEEK_SET);
+  return end - at;
+}
+
+int File::peek() {
+  int c = read();
+  if (c >= 0) {
+    ungetc(c, f_);
+  }
+  return c;
+}
+
+bool SDClass::exists(const char *path) {
+  struct stat st;
+  return stat(path, &st) == 0;
+}
+
+unsigned long millis() { return clock_us() / 1000; }
+unsigned long micros() { return clock_us(); }
+void delay(unsigned long ms) { host_skip(ms * 1000ULL); }
+void delayMicroseconds(unsigned int us) { host_skip(us); }
+void yield() { host_skip(1000); }
+
+void pinMode(uint32_t pin, uint32_t mode) {}
+
+void digitalWrite(uint32_t pin, uint32_t level) {
+  if (pin < NUM_DIGITAL_PINS) {
+    if (pins[pin] != level) {
+      pin_ms[pin] = millis();
+    }
+    pins[pin] = level;
+  }
+}
+
+int digitalRead(uint32_t pin) { return pin < NUM_DIGITAL_PINS ? pins[pin] : 0; }
+
+int analogRead(uint32_t pin) {
+  return pin < NUM_DIGITAL_PINS ? analog[pin] : 0;
+}
+
+void analogReadResolution(int bits) {}
+long random(long howbig) { return howbig > 0 ? rand() % howbig : 0; }
+long random(long howsmall, long howbig) {
+  return howsmall + random(howbig - howsmall);
+}
+void randomSeed(unsigned long seed) { srand(seed); }
+
+void watchdogEnable(uint32_t timeout_ms) {
+  wdt_timeout_ms = timeout_ms;
+  wdt_kick_ms = millis();
+}
+
+void watchdogDisable() { wdt_timeout_ms = 0; }
+
+void watchdogReset() {
+  wdt_check();
+  wdt_kick_ms = millis();
+}
+
+uint32_t pmc_enable_periph_clk(uint32_t id) { return 0; }
+uint32_t can_init(Can *can, uint32_t mck, uint32_t baud_kbps) { return 1; }
+
+void can_reset_all_mailbox(Can *can) {
+  memset(mailboxes, 0, sizeof(mailboxes));
+}
+
+void can_mailbox_init(Can *can, can_mb_conf_t *mb) {
+  if (mb->ul_mb_idx < CAN_MBS) {
+    mailboxes[mb->ul_mb_idx] = *mb;
+  }
+}
+
+uint32_t can_mailbox_get_status(Can *can, uint8_t mb) {
+  if (mb >= CAN_MBS) {
+    return 0;
+  }
+  if (mailboxes[mb].uc_obj_type != CAN_MB_RX_MODE) {
+    return CAN_MSR_MRDY;  // sent the moment it was written
+  }
+  for (size_t i = 0; i < pending.size(); i++) {
+    if (can_match(mailboxes[mb], pending[i])) {
+      return CAN_MSR_MRDY;
+    }
+  }
+  return 0;
+}
+
+uint32_t can_mailbox_read(Can *can, can_mb_conf_t *mb) {
+  for (size_t i = 0; i < pending.size(); i++) {
+    if (mb->ul_mb_idx < CAN_MBS &&
+        can_match(mailboxes[mb->ul_mb_idx], pending[i])) {
+      host_can_frame &frame = pending[i];
+      mb->ul_id = frame.ext ? frame.id : CAN_MID_MIDvA(frame.id);
+      mb->uc_length = frame.dlc;
+      mb->ul_datal = 0;
+      mb->ul_datah = 0;
+      for (int k = 0; k < 4; k++) {
+        mb->ul_datal |= (uint32_t)frame.data[k] << (8 * k);
+        mb->ul_datah |= (uint32_t)frame.data[4 + k] << (8 * k);
+      }
+      pending.erase(pending.begin() + i);
+      return 0;
+    }
+  }
+  return 1;
+}
+
+uint32_t can_mailbox_write(Can *can, can_mb_conf_t *mb) {
+  host_can_frame frame;
+  frame.ext = mb->uc_id_ver;
+  frame.id = frame.ext ? mb->ul_id : mb->ul_id >> CAN_MID_MIDvA_Pos;
+  frame.dlc = mb->uc_length;
+  for (int k = 0; k < 4; k++) {
+    frame.data[k] = mb->ul_datal >> (8 * k);
+    frame.data[4 + k] = mb->ul_datah >> (8 * k);
+  }
+  sent.push_back(frame);
+  return 0;
+}
+
+void can_global_send_transfer_cmd(Can *can, uint8_t mask) {}
+
+uint32_t efc_perform_command(Efc *efc, uint32_t command, uint32_t argument) {
+  return 0;  // the page buffer is the flash already
+}
+
+void quikeval_SPI_connect() {}
+void spi_enable(uint8_t spi_clock_divider) {
+  SPI.setClockDivider(spi_clock_divider);
+}
+
+void host_setup() {
+  for (uint32_t pin = 0; pin < NUM_DIGITAL_PINS; pin++) {
+    analog[pin] = 2048;  // mid scale, 0 A from the current sensor
+  }
+  output.clear();
+  watchdogSetup();
+  setup();
+}
+
+void host_loops(uint32_t n) {
+  for (uint32_t i = 0; i < n; i++, cycles++) {
+    loop();
+  }
+}
+
+bool host_loops_until(const char *text, uint32_t max) {
+  for (uint32_t i = 0; i < max; i++) {
+    if (host_printed(text)) {
+      return true;
+    }
+    host_loops(1);
+  }
+  return host_printed(text);
+}
+
+uint32_t host_cycles() { return cycles; }
+
+void host_skip(uint32_t us) {
+  skipped_us += us;
+  if (tick && !ticking) {
+    ticking = true;
+    tick();
+    ticking = false;
+  }
+  wdt_check();
+}
+
+void host_on_tick(void (*run)()) { tick = run; }
+
+void host_hold_clock(bool on) {
+  uint64_t real = now_us() - start_us;
+  if (on && !held) {
+    held_us = real;
+  } else if (!on && held) {
+    skipped_us -= real - held_us;  // goes on from where it stood
+  }
+  held = on;
+}
+
+void host_console(const char *line) {
+  console_in.insert(console_in.end(), line, line + strlen(line));
+  console_in.push_back('\n');
+}
+
+const std::string &host_output() { return output; }
+bool host_printed(const char *text) {
+  return output.find(text) != std::string::npos;
+}
+void host_clear_output() { output.clear(); }
+void host_echo(bool on) { echo = on; }
+
+void host_printf(const char *format, ...) {
+  char buf[256];
+  va_list args;
+  va_start(args, format);
+  int n = vsnprintf(buf, sizeof(buf), format, args);
+  va_end(args);
+  Serial.write((const uint8_t *)buf, min(n, (int)sizeof(buf) - 1));
+}
+
+int host_pin(uint32_t pin) { return digitalRead(pin); }
+uint32_t host_watchdog_expired() { return wdt_expired; }
+
+uint32_t host_pin_ms(uint32_t pin) {
+  return pin < NUM_DIGITAL_PINS ? pin_ms[pin] : 0;
+}
+
+void host_analog(uint32_t pin, int value) {
+  if (pin < NUM_DIGITAL_PINS) {
+    analog[pin] = value;
+  }
+}
+
+void host_can_send(const host_can_frame &frame) { pending.push_back(frame); }
+std::vector<host_can_frame> &host_can_sent() { return sent; }
+
+int host_report(const char *name) {
+  printf("%s: %s\n", name, host_failures ? "FAILED" : "passed");
+  return host_failures ? 1 : 0;
+}
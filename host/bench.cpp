@@ -0,0 +1,116 @@
+// Sample rate sweep, see bench.h
+#include "bench.h"
+
+#include <SPI.h>
+
+#include "LTC681x.h"
+#include "emulator.h"
+#include "host.h"
+
+// The sketch's side of it
+void calculate();
+
+namespace {
+
+const int TOTAL_IC = 10;  // as in the sketch
+const int CELLS_PER_IC = 12;
+const uint8_t ADC_OPT = ADC_OPT_DISABLED;
+const uint32_t CPU_MHZ = 84;  // Due core clock, MCK of the SPI dividers
+const uint8_t SPI_LEVELS = 3;
+const uint8_t SPI_DIV_LADDER[SPI_LEVELS] = {SPI_CLOCK_DIV16, SPI_CLOCK_DIV32,
+                                            SPI_CLOCK_DIV64};
+const int BENCH_ROUNDS = 1000;   // timed iterations of the CPU part
+const int BENCH_AUX_EVERY = 4;   // ADCVAX: full ADAX once every N samples
+const float BENCH_WAKE_US = 310;  // wakeup_sleep() per IC, CS low 300us + 10us
+
+// How one full pack sample is acquired
+enum bench_strategy {
+  BS_ADCV_ADAX,  // ADCV all + ADAX all, what read_voltage()/temp_detect() do
+  BS_ADCVAX,     // ADCVAX, the full ADAX only every BENCH_AUX_EVERY samples
+  BS_PARTIAL,    // ADCV all + ADAX of one GPIO, round robin
+  BS_COUNT,
+};
+
+}  // namespace
+
+void bench_sweep(uint8_t only_ic) {
+  // One full pack sample = conversions + bus + CPU, back to back like the
+  // loop does it. Conversion times come from the datasheet tables, the bus
+  // from the bytes clocked at each rate of the SPI ladder (1MHz at DIV16),
+  // and the CPU from timing the PEC check and parse of one register group
+  // and calculate() here, scaled to the chain length.
+  const uint8_t ICS[] = {1, 2, 4, 8, TOTAL_IC, 16, 32, 64};
+  const char *const NAMES[BS_COUNT] = {"adcv+adax", "adcvax", "partial"};
+  uint8_t frame[NUM_RX_BYT];
+  uint16_t codes[CELLS_PER_IC];
+  uint8_t pec_match[4];
+  memset(frame, 0x55, sizeof(frame));
+
+  // parse_cells() is given each frame with current_ic 0, its byte offset is
+  // a uint8_t and would wrap past 31 ICs
+  uint32_t start = micros();
+  for (int n = 0; n < BENCH_ROUNDS; n++) {
+    parse_cells(0, 1 + n % 4, frame, codes, pec_match);
+  }
+  float group_us = (micros() - start) / (float)BENCH_ROUNDS;
+  start = micros();
+  for (int n = 0; n < BENCH_ROUNDS / 10; n++) {
+    calculate();
+  }
+  float calc_us = (micros() - start) / (float)(BENCH_ROUNDS / 10) / TOTAL_IC;
+
+  host_printf("ics,md,spi_khz,strategy,conv_us,bus_us,cpu_us,rate_hz,"
+              "bus_pct\n");
+  for (uint8_t i = 0; i < sizeof(ICS); i++) {
+    uint8_t n = ICS[i];
+    if ((only_ic && n != only_ic) || (i > 0 && n == ICS[i - 1])) {
+      continue;
+    }
+    for (uint8_t md = 0; md < 4; md++) {
+      for (uint8_t level = 0; level < SPI_LEVELS; level++) {
+        // MCK / divider, 1000, 500 and 329 kHz (DIV64 is capped at 255)
+        uint16_t khz = CPU_MHZ * 1000 / SPI_DIV_LADDER[level];
+        float byte_us = 8000.0 / khz;
+        for (uint8_t strategy = 0; strategy < BS_COUNT; strategy++) {
+          uint32_t cell_us = emu_conv_us(md, ADC_OPT, EMU_CELL, 0);
+          uint32_t aux_us = emu_conv_us(md, ADC_OPT, EMU_AUX, 0);
+          float conv, bytes, wake, groups;
+          // Command frames and reads are 4 bytes + 8 per IC, wakeup_idle()
+          // is one byte per IC
+          if (strategy == BS_ADCV_ADAX) {
+            conv = cell_us + aux_us;
+            bytes = 2 * 4 + n + 6 * (4 + 8 * n);
+            wake = 2;
+            groups = 6;
+          } else if (strategy == BS_ADCVAX) {
+            conv = cell_us * 8 / 6 + aux_us / (float)BENCH_AUX_EVERY;
+            bytes = 4 + n + 5 * (4 + 8 * n) +
+                    (4 + 2 * (4 + 8 * n)) / (float)BENCH_AUX_EVERY;
+            wake = 1 + 1.0 / BENCH_AUX_EVERY;
+            groups = 5 + 2.0 / BENCH_AUX_EVERY;
+          } else {
+            conv = cell_us + emu_conv_us(md, ADC_OPT, EMU_AUX, 1);
+            bytes = 2 * 4 + n + 5 * (4 + 8 * n);
+            wake = 2;
+            groups = 5;
+          }
+          float bus = bytes * byte_us + wake * n * BENCH_WAKE_US;
+          float cpu = groups * n * group_us + n * calc_us;
+          float period = conv + bus + cpu;
+          host_printf("%u,%u,%u,%s,%.0f,%.0f,%.1f,%.2f,%.1f\n", n, md, khz,
+                      NAMES[strategy], conv, bus, cpu, 1e6 / period,
+                      100 * bus / period);
+        }
+      }
+    }
+  }
+}
+
+void sweep_command(int argc, char **argv) {
+  long ics = 0;
+  if (argc > 2) {
+    host_printf("sweep [ics]\n");
+  } else if (argc == 1 || host_num(argv[1], 1, 64, &ics)) {
+    bench_sweep(ics);
+  }
+}
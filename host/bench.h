@@ -0,0 +1,17 @@
+// Sample rate sweep of the host build. It needs the conversion times of the
+// emulated chain and the full sketch, so it is not part of the firmware,
+// whose `bench` times the pack scan only.
+#ifndef HOST_BENCH_H
+#define HOST_BENCH_H
+
+#include <stdint.h>
+
+// One CSV row per chain length (only_ic alone if not 0), ADC mode, SPI rate
+// and acquisition strategy: the full pack sample rate and the share of it
+// spent on the bus
+void bench_sweep(uint8_t only_ic);
+
+// `sweep [ics]`, see host_command()
+void sweep_command(int argc, char **argv);
+
+#endif  // HOST_BENCH_H
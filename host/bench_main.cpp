@@ -0,0 +1,37 @@
+// Benchmarks of the host build, `bms_bench [ics]`: the pack scan against
+// calculate(), the sample rate sweep of bench.h (for one chain length if
+// given) and the loop profile over a drive on the pack model.
+// The times are those of this machine, the Due's come from `bench` there.
+#include "bench.h"
+#include "host.h"
+#include "sim.h"
+
+namespace {
+
+// Types the command and prints what the cycle that ran it printed
+void run(const char *command) {
+  host_clear_output();
+  host_console(command);
+  host_loops(1);
+  fputs(host_output().c_str(), stdout);
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  uint8_t ics = argc > 1 ? strtoul(argv[1], NULL, 10) : 0;
+  sim_init(0.5, 0.02);
+  host_setup();
+  host_loops(4);
+  run("bench");
+  host_clear_output();
+  bench_sweep(ics);
+  fputs(host_output().c_str(), stdout);
+
+  host_console("mode drive");
+  host_command("sim load 40");
+  host_console("prof reset");
+  host_loops(100);
+  run("prof");
+  return 0;
+}
@@ -0,0 +1,55 @@
+// bms_hardware.cpp of the host build. Instead of the isoSPI port the frames
+// go to the emulated LTC6811 chain (emulator.cpp), or while a trace plays,
+// to the recorded trace, so the library and the sketch run unmodified on
+// top of it. Every frame is handed to the SPI trace as well.
+#include "bms_hardware.h"
+
+#include <Arduino.h>
+
+#include "emulator.h"
+#include "trace.h"
+
+namespace {
+
+const uint16_t PLADC = 0x714;
+bool polling = false;  // PLADC went to emu[] in this CS frame
+uint32_t cs_low_us = 0;
+
+void transfer(const uint8_t *tx, uint16_t tx_len, uint8_t *rx,
+              uint16_t rx_len) {
+  if (trace_answer(tx, rx, rx_len)) {
+    polling = false;  // the trace has no SDO bytes, the ADC reads done
+  } else {
+    emu_transfer(tx, tx_len, rx, rx_len);
+    polling = tx_len >= 4 && (((tx[0] << 8) | tx[1]) & 0x07FF) == PLADC;
+  }
+  trace_record(cs_low_us, tx, tx_len, rx, rx_len);
+}
+
+}  // namespace
+
+void cs_low(uint8_t pin) {
+  cs_low_us = micros();
+  polling = false;
+}
+
+void cs_high(uint8_t pin) { polling = false; }
+
+void delay_u(uint16_t micro) { delayMicroseconds(micro); }
+
+void delay_m(uint16_t milli) { delay(milli); }
+
+void spi_write_array(uint8_t len, uint8_t data[]) {
+  transfer(data, len, NULL, 0);
+}
+
+void spi_write_read(uint8_t tx_Data[], uint8_t tx_len, uint8_t *rx_data,
+                    uint8_t rx_len) {
+  transfer(tx_Data, tx_len, rx_data, rx_len);
+}
+
+uint8_t spi_read_byte(uint8_t tx_dat) {
+  // Clocking SDO after PLADC reads 0 until the conversion is done, anything
+  // else (the wakeup_idle() dummy byte) finds SDO idle high
+  return polling ? emu_poll() : 0xFF;
+}
@@ -0,0 +1,55 @@
+// Commands of the host side. They work on what stands in for the car around
+// the sketch, so they are not in its console, but they read the same way.
+#include "bench.h"
+#include "emulator.h"
+#include "host.h"
+#include "replay.h"
+#include "sim.h"
+#include "trace.h"
+
+namespace {
+
+const int HOST_ARGS = 8;  // words per line, command included
+
+typedef struct {
+  const char *name;
+  void (*run)(int argc, char **argv);  // argv[0] is the command itself
+} host_cmd;
+
+const host_cmd HOST_CMDS[] = {
+    {"emu", emu_command},
+    {"replay", replay_command},
+    {"sim", sim_command},
+    {"sweep", sweep_command},
+    {"trace", trace_command},
+};
+
+}  // namespace
+
+bool host_command(const char *line) {
+  std::string copy = line;
+  char *argv[HOST_ARGS];
+  int argc = 0;
+  for (char *word = strtok(&copy[0], " "); word && argc < HOST_ARGS;
+       word = strtok(NULL, " ")) {
+    argv[argc++] = word;
+  }
+  for (size_t i = 0; argc > 0 && i < sizeof(HOST_CMDS) / sizeof(HOST_CMDS[0]);
+       i++) {
+    if (strcmp(argv[0], HOST_CMDS[i].name) == 0) {
+      HOST_CMDS[i].run(argc, argv);
+      return true;
+    }
+  }
+  return false;
+}
+
+bool host_num(const char *arg, long lo, long hi, long *value) {
+  char *end;
+  *value = strtol(arg, &end, 0);
+  if (*end != '\0' || *value < lo || *value > hi) {
+    host_printf("Expected %ld..%ld, got %s\n", lo, hi, arg);
+    return false;
+  }
+  return true;
+}
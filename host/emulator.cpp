@@ -0,0 +1,363 @@
+// LTC6811 chain of the host build, see emulator.h
+#include "emulator.h"
+
+#include "LTC681x.h"
+#include "host.h"
+
+emu_ic emu[EMU_ICS];
+uint16_t emu_cmd_rate = 0;
+uint8_t emu_link_ic = EMU_ICS;
+bool emu_adc_stuck = false;
+bool emu_noise = true;
+uint32_t emu_stall_us = 0;
+
+namespace {
+
+const uint16_t EMU_CELL_CODE = 37000;  // cell inputs at power up, 3.7 V
+const uint16_t EMU_CELL_SPREAD = 300;  // +- spread of the same
+const uint16_t EMU_DCC_DROP = 130;     // sense wire drop of a bleeding cell
+const uint32_t EMU_WATCHDOG_US = 2000000;  // CFGR resets after it
+const float EMU_THSD_C = 150.0;  // die temperature that trips THSD
+const int PWM_STEPS = 15;        // PWM register value for 100% duty
+
+uint8_t kind = EMU_IDLE;  // emu_conv running
+uint8_t md = 0;           // MD of the running conversion
+uint8_t ch = 0;           // CH/CHG/CHST of the same
+uint8_t dcp = 0;
+uint32_t done_us = 0;  // emu_us() when the running conversion ends
+uint32_t cmd_us = 0;   // last good command, for the watchdog
+uint32_t seed = 1;
+uint32_t frames = 0;
+uint32_t flips = 0;       // frames corrupted on purpose
+uint32_t cmd_errors = 0;  // commands every IC dropped for a bad PEC
+uint32_t wdt_resets = 0;
+
+bool dcto_running(uint8_t ic, uint32_t now) {
+  // DCTO codes 1..15 in seconds, 0 disables the timer
+  const uint16_t DCTO_S[16] = {0,   30,   60,   120,  180,  240,  300,  600,
+                               900, 1200, 1800, 2400, 3600, 4500, 5400, 7200};
+  uint8_t dcto = emu[ic].cfgr[5] >> 4;
+  return dcto != 0 && (now - emu[ic].dcto_us) / 1000000 < DCTO_S[dcto];
+}
+
+void settle(uint32_t now) {
+  // Latch a finished conversion
+  if (kind == EMU_IDLE || emu_adc_stuck || (int32_t)(now - done_us) < 0) {
+    return;
+  }
+  const uint8_t NOISE[4] = {2, 8, 3, 1};  // codes, per MD
+  for (int ic = 0; ic < EMU_ICS; ic++) {
+    emu_ic *e = &emu[ic];
+    uint16_t dcc = e->cfgr[4] | ((e->cfgr[5] & 0x0F) << 8);
+    if (kind == EMU_CELL) {
+      for (int i = 0; i < EMU_CELLS; i++) {
+        if (ch != 0 && i % 6 != ch - 1) {
+          continue;  // CH = n converts cells n and n + 6
+        }
+        int32_t in = e->cell_in[i] + e->cell_bias[i];
+        if (e->open_wire & (1 << i)) {
+          in = 0;  // C(i) floats to C(i+1), the cell below takes its share
+        } else if (i > 0 && (e->open_wire & (1 << (i - 1)))) {
+          in += e->cell_in[i - 1] + e->cell_bias[i - 1];
+        }
+        int32_t noise = emu_noise ? NOISE[md] : 0;
+        int32_t code = in - noise + (int32_t)(emu_rand() % (2 * noise + 1));
+        if (dcp && (dcc & (1 << i))) {
+          code -= EMU_DCC_DROP;  // still bleeding while it is measured
+        }
+        e->cv[i] = constrain(code, 0, 0xFFFE);
+      }
+    } else if (kind == EMU_AUX) {
+      for (int i = 0; i < EMU_GPIOS; i++) {
+        if (ch == 0 || ch == i + 1) {  // no NTC: 10k pull-up to 3 V
+          e->av[i] = (e->ntc_open & (1 << i)) ? 30000 : e->gpio_in[i];
+        }
+      }
+      if (ch == 0 || ch == 6) {
+        e->av[5] = 30000;  // REF2, 3 V
+      }
+    } else {
+      uint32_t sum = 0;
+      uint32_t flags = 0;
+      uint16_t uv = ((e->cfgr[1] | ((e->cfgr[2] & 0x0F) << 8)) + 1) * 16;
+      uint16_t ov = ((e->cfgr[2] >> 4) | (e->cfgr[3] << 4)) * 16;
+      for (int i = 0; i < EMU_CELLS; i++) {
+        sum += e->cell_in[i];
+        flags |= (uint32_t)(e->cell_in[i] < uv) << (2 * i);
+        flags |= (uint32_t)(e->cell_in[i] > ov) << (2 * i + 1);
+      }
+      e->sa[0] = sum / 20;               // SC, 20 * 100uV per LSB
+      e->sa[1] = (e->die_c + 273) * 75;  // ITMP, 7.5mV/K
+      e->sa[2] = 50000;                  // VA
+      e->sa[3] = 33000;                  // VD
+      memcpy(e->flags, &flags, 3);
+      if (e->die_c > EMU_THSD_C) {
+        e->thsd = 1;
+        e->cfgr[4] = 0;  // thermal shutdown ends all discharge
+        e->cfgr[5] &= 0xF0;
+      }
+    }
+  }
+  kind = EMU_IDLE;
+}
+
+void group(uint8_t ic, uint16_t cmd, uint8_t *frame) {
+  // One register group, 6 bytes and the PEC
+  emu_ic *e = &emu[ic];
+  uint16_t words[3];
+  int8_t g = -1;  // bit of bad_groups
+  memset(frame, 0xFF, 6);
+  if (cmd >= 0x004 && cmd <= 0x00A && !(cmd & 1)) {  // RDCVA..D
+    g = (cmd - 0x004) / 2;
+    memcpy(words, &e->cv[3 * g], sizeof(words));
+  } else if (cmd == 0x00C || cmd == 0x00E) {  // RDAUXA/B
+    g = 4 + (cmd - 0x00C) / 2;
+    memcpy(words, &e->av[3 * (g - 4)], sizeof(words));
+  } else if (cmd == 0x010) {  // RDSTATA
+    memcpy(words, e->sa, sizeof(words));
+  } else if (cmd == 0x012) {  // RDSTATB
+    words[0] = e->sa[3];
+    words[1] = e->flags[0] | (e->flags[1] << 8);
+    words[2] = e->flags[2] | (e->thsd << 8);
+  } else if (cmd == 0x002 || cmd == 0x022) {  // RDCFG, RDPWM
+    memcpy(words, cmd == 0x002 ? e->cfgr : e->pwmr, 6);
+  } else {
+    return;  // not a read the emulator knows, SDO stays high
+  }
+  for (int i = 0; i < 3; i++) {
+    frame[2 * i] = words[i] & 0xFF;
+    frame[2 * i + 1] = words[i] >> 8;
+  }
+  uint16_t pec = pec15_calc(6, frame);
+  if (g >= 0 && (e->bad_groups & (1 << g))) {
+    pec ^= 0x0001;  // the LSB of a good PEC is always 0
+  }
+  frame[6] = pec >> 8;
+  frame[7] = pec;
+}
+
+struct power_up {
+  power_up() { emu_init(); }
+} power;
+
+}  // namespace
+
+void emu_init() {
+  for (int ic = 0; ic < EMU_ICS; ic++) {
+    emu_ic *e = &emu[ic];
+    memset(e, 0xFF, sizeof(emu_ic));  // registers read 0xFFFF until converted
+    for (int i = 0; i < EMU_CELLS; i++) {
+      e->cell_in[i] =
+          EMU_CELL_CODE + emu_rand() % (2 * EMU_CELL_SPREAD) - EMU_CELL_SPREAD;
+    }
+    for (int i = 0; i < EMU_GPIOS; i++) {
+      e->gpio_in[i] = emu_ntc_code(25);
+    }
+    e->die_c = 30;
+    memset(e->cfgr, 0, sizeof(e->cfgr));
+    e->cfgr[0] = 0xF8;  // power up: GPIO pull-downs off, REFON = 0
+    e->thsd = 0;
+    e->pec_rate = 0;
+    memset(e->cell_bias, 0, sizeof(e->cell_bias));
+    e->open_wire = 0;
+    e->ntc_open = 0;
+    e->bad_groups = 0;
+    e->dcto_us = 0;
+  }
+  cmd_us = 0;
+}
+
+void emu_transfer(const uint8_t *tx, uint16_t tx_len, uint8_t *rx,
+                  uint16_t rx_len) {
+  uint32_t now = emu_us();
+  if (rx_len) {
+    memset(rx, 0xFF, rx_len);  // nothing drives SDO
+  }
+  frames++;
+  settle(now);
+
+  uint16_t cmd = ((tx[0] << 8) | tx[1]) & 0x07FF;
+  if (pec15_calc(2, (uint8_t *)tx) != ((tx[2] << 8) | tx[3]) ||
+      emu_rand() % 1000 < emu_cmd_rate) {
+    cmd_errors++;
+    return;  // every IC drops a command with a bad PEC
+  }
+  if (now - cmd_us > EMU_WATCHDOG_US) {
+    for (int ic = 0; ic < EMU_ICS; ic++) {
+      // A running discharge timer keeps DCC and DCTO, and the PWM register
+      // that has been driving the S pins since the watchdog expired
+      emu_ic *e = &emu[ic];
+      bool keep = dcto_running(ic, now);
+      uint8_t dcc[2] = {e->cfgr[4], e->cfgr[5]};
+      memset(e->cfgr, 0, 6);
+      e->cfgr[0] = 0xF8;
+      if (keep) {
+        e->cfgr[4] = dcc[0];
+        e->cfgr[5] = dcc[1];
+      } else {
+        memset(e->pwmr, 0xFF, 6);
+      }
+    }
+    wdt_resets++;
+  }
+  for (int ic = 0; ic < EMU_ICS; ic++) {
+    emu_ic *e = &emu[ic];
+    if ((e->cfgr[5] >> 4) && !dcto_running(ic, now)) {
+      e->cfgr[4] = 0;  // the discharge timer ran out
+      e->cfgr[5] &= 0xF0;
+    }
+  }
+  cmd_us = now;
+
+  if ((cmd & 0x668) == 0x260 || (cmd & 0x678) == 0x460 ||
+      (cmd & 0x678) == 0x468) {  // ADCV, ADAX, ADSTAT
+    kind = (cmd & 0x668) == 0x260   ? EMU_CELL
+           : (cmd & 0x678) == 0x460 ? EMU_AUX
+                                    : EMU_STAT;
+    md = (cmd >> 7) & 0x03;
+    ch = cmd & 0x07;
+    dcp = (cmd >> 4) & 0x01;
+    done_us = now + emu_conv_us(md, emu[0].cfgr[0] & 0x01, kind, ch) +
+              emu_stall_us;
+  } else if (cmd == 0x001 || cmd == 0x020) {  // WRCFG, WRPWM
+    for (int k = 0; k < EMU_ICS && 4 + (k + 1) * NUM_RX_BYT <= tx_len; k++) {
+      const uint8_t *data = &tx[4 + k * NUM_RX_BYT];
+      if (EMU_ICS - 1 - k >= emu_link_ic) {
+        continue;  // the write never got past the break
+      }
+      emu_ic *e = &emu[EMU_ICS - 1 - k];
+      bool flip = emu_rand() % 1000 < e->pec_rate;
+      flips += flip;
+      uint16_t pec = (data[6] << 8) | data[7];
+      if (!flip && pec15_calc(6, (uint8_t *)data) == pec) {
+        memcpy(cmd == 0x001 ? e->cfgr : e->pwmr, data, 6);
+        if (cmd == 0x001) {
+          e->dcto_us = now;  // every WRCFG restarts the discharge timer
+        }
+      }
+    }
+  } else if (cmd == 0x711 || cmd == 0x712) {  // CLRCELL, CLRAUX
+    for (int ic = 0; ic < EMU_ICS; ic++) {
+      memset(cmd == 0x711 ? (void *)emu[ic].cv : (void *)emu[ic].av, 0xFF,
+             cmd == 0x711 ? sizeof(emu[0].cv) : sizeof(emu[0].av));
+    }
+  } else if (rx_len >= NUM_RX_BYT * EMU_ICS) {  // RDxxx
+    for (int ic = 0; ic < emu_link_ic; ic++) {
+      uint8_t *frame = &rx[ic * NUM_RX_BYT];
+      group(ic, cmd, frame);
+      if (emu_rand() % 1000 < emu[ic].pec_rate) {
+        frame[emu_rand() % NUM_RX_BYT] ^= 1 << (emu_rand() % 8);
+        flips++;
+      }
+    }
+  }
+}
+
+uint8_t emu_poll() {
+  // One byte clocked out of SDO after PLADC, 0 while the conversion runs.
+  // Each one skips the host clock by the 10 us LTC681x_pollAdc() counts per
+  // byte, so a poll reports the conversion time without sitting it out.
+  if (kind == EMU_IDLE) {
+    return 0xFF;
+  }
+  if (emu_adc_stuck || (int32_t)(emu_us() - done_us) < 0) {
+    host_skip(10);
+    return 0;
+  }
+  settle(emu_us());
+  return 0xFF;
+}
+
+uint32_t emu_us() { return micros(); }
+
+uint32_t emu_conv_us(uint8_t md, bool adcopt, uint8_t kind, uint8_t ch) {
+  // From the LTC6811 conversion time tables. ADCOPT picks the second rate
+  // of each MD pair.
+  const uint32_t ALL_US[2][4] = {{12807, 1113, 2335, 201317},
+                                 {6409, 1288, 3033, 4407}};
+  uint32_t t = ALL_US[adcopt][md];
+  if (kind == EMU_STAT) {
+    t = ch == 0 ? t * 2 / 3 : t / 6;
+  } else if (ch != 0) {
+    t /= 6;  // one pair of cells or one GPIO
+  }
+  return t;
+}
+
+float emu_s_duty(uint8_t ic, uint8_t cell, uint32_t now) {
+  // DCC turns the S pin on while the watchdog runs. Once it has expired
+  // only a running discharge timer keeps DCC, and the PWM register sets
+  // the share of the time the pin is on.
+  const emu_ic *e = &emu[ic];
+  uint16_t dcc = e->cfgr[4] | ((e->cfgr[5] & 0x0F) << 8);
+  bool timer = e->cfgr[5] >> 4;
+  bool running = dcto_running(ic, now);
+  if (!(dcc & (1 << cell)) || (timer && !running)) {
+    return 0;
+  }
+  if (now - cmd_us <= EMU_WATCHDOG_US) {
+    return 1;
+  }
+  if (!running) {
+    return 0;
+  }
+  return ((e->pwmr[cell / 2] >> (4 * (cell % 2))) & 0x0F) / (float)PWM_STEPS;
+}
+
+uint16_t emu_ntc_code(float deg_c) {
+  // Same NTC and 10k divider from 3 V as temp_detect() of the sketch
+  float beta = log(32650 / 588.6) / ((1 / 273.15) - (1 / 378.15));
+  float r = 10000 * exp(beta * (1 / (deg_c + 273.15) - 1 / 298.15));
+  return 3.0 * r / (10000 + r) * 10000;
+}
+
+uint32_t emu_rand() {
+  seed ^= seed << 13;
+  seed ^= seed >> 17;
+  seed ^= seed << 5;
+  return seed;
+}
+
+void emu_command(int argc, char **argv) {
+  const char *what = argc >= 2 ? argv[1] : "";
+  long ic, ch, value;
+  if (strcmp(what, "cell") == 0 && argc == 5 &&
+      host_num(argv[2], 0, EMU_ICS - 1, &ic) &&
+      host_num(argv[3], 1, EMU_CELLS, &ch) &&
+      host_num(argv[4], 0, 65535, &value)) {
+    emu[ic].cell_in[ch - 1] = value;
+  } else if (strcmp(what, "temp") == 0 && argc == 5 &&
+             host_num(argv[2], 0, EMU_ICS - 1, &ic) &&
+             host_num(argv[3], 0, EMU_GPIOS - 1, &ch) &&
+             host_num(argv[4], -40, 125, &value)) {
+    emu[ic].gpio_in[ch] = emu_ntc_code(value);
+  } else if (strcmp(what, "die") == 0 && argc == 4 &&
+             host_num(argv[2], 0, EMU_ICS - 1, &ic) &&
+             host_num(argv[3], -40, 200, &value)) {
+    emu[ic].die_c = value;
+  } else if (strcmp(what, "pec") == 0 && argc == 4 &&
+             host_num(argv[3], 0, 1000, &value)) {
+    bool all = strcmp(argv[2], "all") == 0;
+    if (!all && !host_num(argv[2], 0, EMU_ICS - 1, &ic)) {
+      return;
+    }
+    for (int k = 0; k < EMU_ICS; k++) {
+      if (all || k == ic) {
+        emu[k].pec_rate = value;
+      }
+    }
+  } else if (strcmp(what, "cmd") == 0 && argc == 3 &&
+             host_num(argv[2], 0, 1000, &value)) {
+    emu_cmd_rate = value;
+  } else if (strcmp(what, "stall") == 0 && argc == 3 &&
+             host_num(argv[2], 0, 150, &value)) {
+    emu_stall_us = value * 1000;  // past 200 ms PLADC times out instead
+  } else if (strcmp(what, "stats") == 0) {
+    host_printf("Frames %u, flipped %u, bad commands %u, watchdog resets %u\n",
+                frames, flips, cmd_errors, wdt_resets);
+  } else {
+    host_printf("emu cell <ic> <cell> <code> | temp <ic> <gpio> <deg C>\n");
+    host_printf("    die <ic> <deg C> | pec <ic|all> <per mille>\n");
+    host_printf("    cmd <per mille> | stall <ms> | stats\n");
+  }
+}
@@ -0,0 +1,63 @@
+// LTC6811 daisy chain of the host build. host/bms_hardware.cpp hands it the
+// SPI frames exactly as the library sends them. The inputs of emu[] are what
+// the pins of each IC see, the registers what it would answer with.
+// Conversions latch inputs into registers once their MD dependent time is
+// up, like the real part.
+#ifndef HOST_EMULATOR_H
+#define HOST_EMULATOR_H
+
+#include <stdint.h>
+
+const int EMU_ICS = 10;  // TOTAL_IC of the sketch
+const int EMU_CELLS = 12;
+const int EMU_GPIOS = 5;  // GPIO1..5 carry the NTCs
+
+enum emu_conv {
+  EMU_IDLE,
+  EMU_CELL,
+  EMU_AUX,
+  EMU_STAT,
+};
+
+typedef struct {
+  uint16_t cell_in[EMU_CELLS];  // 100uV
+  uint16_t gpio_in[EMU_GPIOS];  // 100uV
+  float die_c;
+  uint8_t cfgr[6];
+  uint8_t pwmr[6];
+  uint16_t cv[EMU_CELLS];  // cell voltage registers
+  uint16_t av[6];          // GPIO1..5, REF2
+  uint16_t sa[4];          // SC, ITMP, VA, VD
+  uint8_t flags[3];        // UV/OV, two bits per cell
+  uint8_t thsd;
+  uint16_t pec_rate;  // per mille of the frames of this IC that get a bit flip
+  int16_t cell_bias[EMU_CELLS];  // added to cell_in, injected faults
+  uint16_t open_wire;  // bit i: the lower sense wire of cell i is open
+  uint8_t ntc_open;    // bit i: the NTC on GPIO i+1 is unplugged
+  uint8_t bad_groups;  // bit g: RDCVA..D, then RDAUXA/B, always fail PEC
+  uint32_t dcto_us;    // emu_us() of the last WRCFG, the discharge timer
+} emu_ic;
+
+extern emu_ic emu[EMU_ICS];
+extern uint16_t emu_cmd_rate;  // per mille of the commands that get corrupted
+extern uint8_t emu_link_ic;    // ICs from here on are past an isoSPI break
+extern bool emu_adc_stuck;     // conversions start but never end
+extern bool emu_noise;         // ADC noise on the cell codes, on at power up
+extern uint32_t emu_stall_us;  // every conversion ends this much later
+
+// Powered up before main(), cells around 3.7 V and every NTC at 25 deg C
+void emu_init();
+void emu_transfer(const uint8_t *tx, uint16_t tx_len, uint8_t *rx,
+                  uint16_t rx_len);
+uint8_t emu_poll();  // SDO after PLADC
+uint32_t emu_us();   // the clock the chain runs on
+// Datasheet time of a conversion of every channel, or of ch alone
+uint32_t emu_conv_us(uint8_t md, bool adcopt, uint8_t kind, uint8_t ch);
+float emu_s_duty(uint8_t ic, uint8_t cell, uint32_t now);  // S pin share
+uint16_t emu_ntc_code(float deg_c);  // GPIO input of the NTC divider
+uint32_t emu_rand();  // xorshift, the same run every time
+
+// `emu cell|temp|die|pec|cmd|stall|stats`, see host_command()
+void emu_command(int argc, char **argv);
+
+#endif  // HOST_EMULATOR_H
@@ -0,0 +1,70 @@
+// Test side of the host build. A test runs setup() and loop() of the sketch
+// like the Due core would, types into the console, puts frames on the CAN
+// bus and looks at what the sketch printed, sent and did with its pins.
+#ifndef HOST_HOST_H
+#define HOST_HOST_H
+
+#include <Arduino.h>
+
+void setup();
+void loop();
+
+// Runs watchdogSetup() and setup(), then loop() for the given number of
+// cycles
+void host_setup();
+void host_loops(uint32_t n);
+// Runs loop() until text is printed or max cycles went by, true if printed
+bool host_loops_until(const char *text, uint32_t max);
+uint32_t host_cycles();
+
+// The clock of the sketch is the real one plus every wait it asked for.
+// delay(), delayMicroseconds() and yield() skip it forward instead of
+// spinning, so the sketch sees its timing but no cycle waits in real time.
+void host_skip(uint32_t us);
+// Called on every skip, for what runs beside the sketch (the pack model)
+void host_on_tick(void (*run)());
+// Stops the real time part of the clock, so only skips move it and a run
+// takes the same time every time (replay)
+void host_hold_clock(bool on);
+// Times the watchdog ran out, each one a reset on the Due
+uint32_t host_watchdog_expired();
+
+// Console, a line is typed in as a whole on the next read
+void host_console(const char *line);
+const std::string &host_output();  // everything since the last clear
+bool host_printed(const char *text);
+void host_clear_output();
+void host_echo(bool on);  // copy the output to stdout as well
+void host_printf(const char *format, ...);  // host side, into the output too
+
+// Commands of the host side, `trace on` and so on, run at once. Returns
+// false if the line is not one of them, so it can go to the console instead.
+bool host_command(const char *line);
+// A number in lo..hi for a host command, complains like the console if not
+bool host_num(const char *arg, long lo, long hi, long *value);
+
+int host_pin(uint32_t pin);  // last level written
+uint32_t host_pin_ms(uint32_t pin);  // millis() when it was, for latencies
+void host_analog(uint32_t pin, int value);
+
+typedef struct {
+  uint32_t id;  // 11 or 29 bit
+  bool ext;
+  uint8_t dlc;
+  uint8_t data[8];
+} host_can_frame;
+void host_can_send(const host_can_frame &frame);  // to the BMS
+std::vector<host_can_frame> &host_can_sent();     // by the BMS, oldest first
+
+// Checks, main() of a test returns host_report()
+extern int host_failures;
+#define HOST_CHECK(cond)                                              \
+  do {                                                                \
+    if (!(cond)) {                                                    \
+      printf("%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #cond); \
+      host_failures++;                                                \
+    }                                                                 \
+  } while (0)
+int host_report(const char *name);
+
+#endif  // HOST_HOST_H
@@ -0,0 +1,209 @@
+// Arduino Due core as far as bms_new.ino and the LTC681x library use it, for
+// the host build. Serial goes to a buffer the tests read, the pins, CAN and
+// flash are plain memory, see host/host.h for the test side of them.
+#ifndef HOST_ARDUINO_H
+#define HOST_ARDUINO_H
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// What host/ itself uses of the standard library, ahead of the min and max
+// macros that would break it
+#include <deque>
+#include <string>
+#include <vector>
+
+typedef bool boolean;
+typedef uint8_t byte;
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+#define DEC 10
+#define HEX 16
+#define A0 54
+#define SS 10
+#define NUM_DIGITAL_PINS 80
+
+#define PROGMEM
+#define pgm_read_word_near(addr) (*(const uint16_t *)(addr))
+class __FlashStringHelper;
+#define F(s) ((const __FlashStringHelper *)(s))
+
+// Macros on the Due as well, so mixed types compare like there
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#define max(a, b) ((a) > (b) ? (a) : (b))
+#define constrain(amt, low, high) \
+  ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+
+class Print {
+ public:
+  virtual ~Print() {}
+  virtual size_t write(uint8_t c) = 0;
+  virtual size_t write(const uint8_t *buf, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+      write(buf[i]);
+    }
+    return n;
+  }
+  size_t write(const char *s) { return write((const uint8_t *)s, strlen(s)); }
+
+  size_t print(const char *s) { return write(s); }
+  size_t print(const __FlashStringHelper *s) { return write((const char *)s); }
+  size_t print(char c) { return write((uint8_t)c); }
+  size_t print(unsigned char v, int base = DEC) {
+    return print((unsigned long)v, base);
+  }
+  size_t print(int v, int base = DEC) { return print((long)v, base); }
+  size_t print(unsigned v, int base = DEC) {
+    return print((unsigned long)v, base);
+  }
+  size_t print(long v, int base = DEC) {
+    if (base == DEC) {
+      return printf_("%ld", v);
+    }
+    return print((unsigned long)v, base);
+  }
+  size_t print(unsigned long v, int base = DEC) {
+    return printf_(base == HEX ? "%lX" : "%lu", v);
+  }
+  size_t print(double v, int digits = 2) { return printf_("%.*f", digits, v); }
+
+  template <typename T>
+  size_t println(T v) {
+    return print(v) + println();
+  }
+  template <typename T>
+  size_t println(T v, int base) {
+    return print(v, base) + println();
+  }
+  size_t println() { return write("\r\n"); }
+
+  int availableForWrite() { return 64; }
+
+ private:
+  size_t printf_(const char *format, ...);
+};
+
+class Stream : public Print {
+ public:
+  virtual int available() = 0;
+  virtual int read() = 0;
+  virtual int peek() = 0;
+};
+
+// Output collects in host_output(), input comes from host_console()
+class HardwareSerial : public Stream {
+ public:
+  void begin(unsigned long) {}
+  void flush() {}
+  int available();
+  int read();
+  int peek();
+  size_t write(uint8_t c);
+  using Print::write;
+  size_t readBytes(char *buf, size_t n);
+  operator bool() { return true; }
+};
+extern HardwareSerial Serial;
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+void yield();  // empty on the Due, skips the host clock here
+void pinMode(uint32_t pin, uint32_t mode);
+void digitalWrite(uint32_t pin, uint32_t level);
+int digitalRead(uint32_t pin);
+int analogRead(uint32_t pin);
+void analogReadResolution(int bits);
+long random(long howbig);
+long random(long howsmall, long howbig);
+void randomSeed(unsigned long seed);
+
+// Due core watchdog, on the host clock. Instead of a reset host_printf()
+// reports the moment it runs out, see host_watchdog_expired().
+void watchdogSetup();  // the sketch's, called before setup()
+void watchdogEnable(uint32_t timeout_ms);
+void watchdogDisable();
+void watchdogReset();
+
+// libsam CAN, the subset can_setup() and can_service() use
+typedef struct {
+  uint32_t dummy;
+} Can;
+extern Can host_can0;
+#define CAN0 (&host_can0)
+#define ID_CAN0 43
+extern uint32_t SystemCoreClock;
+typedef struct {
+  uint32_t ul_mb_idx;
+  uint8_t uc_obj_type;
+  uint8_t uc_id_ver;
+  uint8_t uc_length;
+  uint8_t uc_tx_prio;
+  uint32_t ul_status;
+  uint32_t ul_id_msk;
+  uint32_t ul_id;
+  uint32_t ul_fid;
+  uint32_t ul_datal;
+  uint32_t ul_datah;
+} can_mb_conf_t;
+#define CAN_MB_DISABLE_MODE 0
+#define CAN_MB_RX_MODE 1
+#define CAN_MB_TX_MODE 3
+#define CAN_BPS_1000K 1000
+#define CAN_BPS_500K 500
+#define CAN_BPS_250K 250
+#define CAN_MSR_MRDY (1u << 23)
+#define CAN_MID_MIDvA_Pos 18
+#define CAN_MID_MIDvA_Msk (0x7FFu << CAN_MID_MIDvA_Pos)
+#define CAN_MID_MIDvA(value) \
+  (CAN_MID_MIDvA_Msk & ((value) << CAN_MID_MIDvA_Pos))
+#define CAN_MAM_MIDvA_Pos 18
+#define CAN_MAM_MIDvA_Msk (0x7FFu << CAN_MAM_MIDvA_Pos)
+#define CAN_TCR_MB0 (1u << 0)
+uint32_t pmc_enable_periph_clk(uint32_t id);
+uint32_t can_init(Can *can, uint32_t mck, uint32_t baud_kbps);
+void can_reset_all_mailbox(Can *can);
+void can_mailbox_init(Can *can, can_mb_conf_t *mb);
+uint32_t can_mailbox_get_status(Can *can, uint8_t mb);
+uint32_t can_mailbox_read(Can *can, can_mb_conf_t *mb);
+uint32_t can_mailbox_write(Can *can, can_mb_conf_t *mb);
+void can_global_send_transfer_cmd(Can *can, uint8_t mask);
+
+// libsam EFC, the config pages live in host_iflash1
+typedef struct {
+  uint32_t dummy;
+} Efc;
+extern Efc host_efc1;
+#define EFC1 (&host_efc1)
+#define IFLASH1_PAGE_SIZE 256
+#define IFLASH1_NB_OF_PAGES 1024
+extern uint8_t host_iflash1[IFLASH1_PAGE_SIZE * IFLASH1_NB_OF_PAGES];
+#define IFLASH1_ADDR (host_iflash1)
+#define EFC_FCMD_EWP 0x03
+uint32_t efc_perform_command(Efc *efc, uint32_t command, uint32_t argument);
+
+// Reset controller and backup registers, set by a test before setup()
+typedef struct {
+  uint32_t RSTC_CR;
+  uint32_t RSTC_SR;
+  uint32_t RSTC_MR;
+} Rstc;
+typedef struct {
+  uint32_t SYS_GPBR[8];
+} Gpbr;
+extern Rstc host_rstc;
+extern Gpbr host_gpbr;
+#define RSTC (&host_rstc)
+#define GPBR (&host_gpbr)
+#define RSTC_SR_RSTTYP_Pos 8
+#define RSTC_SR_RSTTYP_Msk (0x7u << RSTC_SR_RSTTYP_Pos)
+
+#endif  // HOST_ARDUINO_H
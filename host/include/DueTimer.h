@@ -0,0 +1,14 @@
+// DueTimer, only referenced from commented out code in the sketch
+#ifndef HOST_DUETIMER_H
+#define HOST_DUETIMER_H
+
+class DueTimer {
+ public:
+  DueTimer &attachInterrupt(void (*isr)()) { return *this; }
+  DueTimer &setFrequency(double hz) { return *this; }
+  DueTimer &start() { return *this; }
+  DueTimer &stop() { return *this; }
+};
+extern DueTimer Timer0;
+
+#endif  // HOST_DUETIMER_H
@@ -0,0 +1,52 @@
+// SD library over the host file system, files are opened relative to the
+// working directory of the test.
+#ifndef HOST_SD_H
+#define HOST_SD_H
+
+#include <Arduino.h>
+
+#define FILE_READ 0
+#define FILE_WRITE 1
+
+class File : public Stream {
+ public:
+  File() : f_(NULL) {}
+  explicit File(FILE *f) : f_(f) {}
+  operator bool() { return f_ != NULL; }
+  size_t write(uint8_t c) { return f_ ? fwrite(&c, 1, 1, f_) : 0; }
+  size_t write(const uint8_t *buf, size_t n) {
+    return f_ ? fwrite(buf, 1, n, f_) : 0;
+  }
+  using Print::write;
+  int available();
+  int read() { return f_ ? fgetc(f_) : -1; }
+  int read(void *buf, size_t n) { return f_ ? fread(buf, 1, n, f_) : 0; }
+  int peek();
+  void flush() {
+    if (f_) {
+      fflush(f_);
+    }
+  }
+  void close() {
+    if (f_) {
+      fclose(f_);
+    }
+    f_ = NULL;
+  }
+
+ private:
+  FILE *f_;
+};
+
+class SDClass {
+ public:
+  bool begin(uint8_t) { return true; }
+  File open(const char *path, uint8_t mode = FILE_READ) {
+    return File(fopen(path, mode == FILE_WRITE ? "ab" : "rb"));
+  }
+  bool exists(const char *path);
+  bool remove(const char *path) { return ::remove(path) == 0; }
+};
+extern SDClass SD;
+
+#endif  // HOST_SD_H
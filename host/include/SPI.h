@@ -0,0 +1,27 @@
+// Due SPI as LT_SPI.h sees it. Nothing is on this bus in the host build, the
+// chain is reached through host/bms_hardware.cpp.
+#ifndef HOST_SPI_H
+#define HOST_SPI_H
+
+#include <Arduino.h>
+
+// SCK = 84 MHz / divider on the Due
+#define SPI_CLOCK_DIV2 11
+#define SPI_CLOCK_DIV4 21
+#define SPI_CLOCK_DIV8 42
+#define SPI_CLOCK_DIV16 84
+#define SPI_CLOCK_DIV32 168
+#define SPI_CLOCK_DIV64 255
+#define SPI_CLOCK_DIV128 255
+
+class SPIClass {
+ public:
+  void begin() {}
+  void end() {}
+  void setClockDivider(uint8_t divider) { clock_divider = divider; }
+  uint8_t transfer(uint8_t) { return 0xFF; }
+  uint8_t clock_divider = SPI_CLOCK_DIV4;
+};
+extern SPIClass SPI;
+
+#endif  // HOST_SPI_H
@@ -0,0 +1,37 @@
+// The sketch with its console on stdin and stdout, on the emulated chain and
+// the pack model. A line that is a host command (`emu`, `replay`, `sim`,
+// `sweep`, `trace`) runs at once, any other goes to the console. Runs the
+// given number of cycles, or until killed.
+#include <poll.h>
+#include <unistd.h>
+
+#include "host.h"
+#include "sim.h"
+
+int main(int argc, char **argv) {
+  uint32_t cycles = argc > 1 ? strtoul(argv[1], NULL, 10) : 0;
+  host_echo(true);
+  sim_init(0.5, 0.02);
+  host_setup();
+  std::string line;
+  bool more = true;
+  for (uint32_t i = 0; cycles == 0 || i < cycles; i++) {
+    pollfd in = {STDIN_FILENO, POLLIN, 0};
+    while (more && poll(&in, 1, 0) > 0) {
+      char c;
+      if (read(STDIN_FILENO, &c, 1) != 1) {
+        more = false;  // piped input ran out, keep the loop going
+      } else if (c == '\n') {
+        if (!host_command(line.c_str())) {
+          host_console(line.c_str());
+        }
+        line.clear();
+      } else {
+        line += c;
+      }
+    }
+    host_loops(1);
+    fflush(stdout);
+  }
+  return 0;
+}
@@ -0,0 +1,189 @@
+// Log replay, see replay.h
+#include "replay.h"
+
+#include "emulator.h"
+#include "host.h"
+#include "sim.h"
+
+// The sketch's side of it
+extern uint16_t dcc_cache[];
+extern bool manual_fault;
+void console_exec(char *line);
+uint32_t crc32(const uint8_t *data, uint32_t length);
+
+namespace {
+
+const int TOTAL_IC = 10;  // as in the sketch
+const int CELLS_PER_IC = 12;
+const uint16_t LOG_MAGIC = 0x4C46;
+const uint32_t PACK_CURRENT_PIN = A0;
+const float CURRENT_SENSOR_OFFSET = 1.65;
+const float CURRENT_SENSOR_GAIN = 0.0066;
+const uint32_t ID_STATUS = 0x603;
+const uint32_t ID_CHARGER_REQ = 0x1806E5F4;
+const char *STATES[] = {"INIT",         "IDLE",
+                        "DRIVE",        "CHARGE",
+                        "BALANCE_ONLY", "FAULT_RECOVERABLE",
+                        "FAULT_LATCHED"};  // SM_STATES of the sketch
+const char *MODES[] = {"idle", "drive", "charge", "balance"};  // bms_request
+
+// One check_stat() cycle as the sketch writes it, little endian
+typedef struct {
+  uint16_t magic;
+  uint8_t total_ic;
+  uint8_t request;
+  uint32_t ms;
+  uint16_t cells[TOTAL_IC][CELLS_PER_IC];
+  uint16_t aux[TOTAL_IC][6];
+  uint16_t itmp[TOTAL_IC];
+  uint16_t cell_stale[TOTAL_IC];
+  uint8_t aux_stale[TOTAL_IC];
+  int16_t current_da;
+  uint8_t flags;
+  uint8_t reserved[3];
+  uint32_t crc;
+} log_frame;
+
+// The decisions of a cycle: state, fault, charge request and the DCC bits
+// of every IC
+typedef struct {
+  uint8_t state;
+  uint8_t fault;
+  uint16_t charge_da;
+  uint16_t dcc[TOTAL_IC];
+} decision;
+
+void apply(const log_frame *f) {
+  for (int ic = 0; ic < TOTAL_IC; ic++) {
+    emu_ic *e = &emu[ic];
+    memcpy(e->cell_in, f->cells[ic], sizeof(e->cell_in));
+    memcpy(e->gpio_in, f->aux[ic], sizeof(e->gpio_in));
+    e->die_c = (f->itmp[ic] + 0.5) / 75 - 273;  // ITMP, 7.5mV/K
+    e->bad_groups = 0;
+    for (int g = 0; g < 4; g++) {
+      e->bad_groups |= ((f->cell_stale[ic] >> (3 * g)) & 0x07) ? 1 << g : 0;
+    }
+    for (int g = 0; g < 2; g++) {
+      e->bad_groups |= ((f->aux_stale[ic] >> (3 * g)) & 0x07) ? 1 << (4 + g)
+                                                              : 0;
+    }
+  }
+  float volts =
+      CURRENT_SENSOR_OFFSET + f->current_da * 0.1 * CURRENT_SENSOR_GAIN;
+  host_analog(PACK_CURRENT_PIN, constrain(volts / 3.3 * 4095 + 0.5, 0, 4095));
+  manual_fault = f->flags & 0x01;
+}
+
+// The latest frame with this identifier the BMS sent, false if none
+bool latest(uint32_t id, bool ext, host_can_frame *frame) {
+  const std::vector<host_can_frame> &sent = host_can_sent();
+  for (size_t i = sent.size(); i-- > 0;) {
+    if (sent[i].id == id && sent[i].ext == ext) {
+      *frame = sent[i];
+      return true;
+    }
+  }
+  return false;
+}
+
+void decide(decision *d) {
+  host_can_frame frame;
+  memset(d, 0, sizeof(*d));
+  if (latest(ID_STATUS, false, &frame)) {
+    d->state = frame.data[0];
+    d->fault = frame.data[1];
+  }
+  if (latest(ID_CHARGER_REQ, true, &frame)) {
+    d->charge_da = (frame.data[2] << 8) | frame.data[3];
+  }
+  memcpy(d->dcc, dcc_cache, sizeof(d->dcc));
+}
+
+void print(uint32_t ms, const decision *d) {
+  host_printf("R %lu %s fault %d chg %.1f dcc", (unsigned long)ms,
+              d->state < sizeof(STATES) / sizeof(STATES[0]) ? STATES[d->state]
+                                                            : "?",
+              (int8_t)d->fault, d->charge_da * 0.1);
+  for (int ic = 0; ic < TOTAL_IC; ic++) {
+    host_printf(" %X", d->dcc[ic]);
+  }
+  host_printf("\n");
+}
+
+}  // namespace
+
+bool replay_run(const char *path) {
+  FILE *in = fopen(path, "rb");
+  if (!in) {
+    host_printf("Can't open the log\n");
+    return false;
+  }
+  sim_stop();  // the log is the pack now
+  emu_noise = false;
+  host_hold_clock(true);
+  uint32_t frames = 0;
+  uint32_t changes = 0;
+  uint32_t digest = 0;  // crc32 chained over every decision
+  uint32_t start_ms = millis();
+  uint32_t first_ms = 0;
+  uint8_t request = 0xFF;
+  decision last;
+  memset(&last, 0xFF, sizeof(last));
+  log_frame f;
+  while (fread(&f, sizeof(f), 1, in) == 1) {
+    if (f.magic != LOG_MAGIC || f.total_ic != TOTAL_IC ||
+        f.crc != crc32((const uint8_t *)&f, offsetof(log_frame, crc))) {
+      host_printf("Bad log frame skipped\n");
+      continue;
+    }
+    if (frames++ == 0) {
+      first_ms = f.ms;
+    }
+    // The cycle starts no earlier than the logged one did
+    int32_t ahead = start_ms + (f.ms - first_ms) - millis();
+    if (ahead > 0) {
+      host_skip(ahead * 1000UL);
+    }
+    apply(&f);
+    if (f.request != request && f.request < 4) {
+      char line[16];
+      snprintf(line, sizeof(line), "mode %s", MODES[f.request]);
+      console_exec(line);
+      request = f.request;
+    }
+    host_loops(1);
+
+    // Only cycles where a decision changed are printed, so two builds
+    // replaying the same log can be compared with a plain diff, or by the
+    // digest alone
+    decision d;
+    decide(&d);
+    digest = crc32((const uint8_t *)&d, sizeof(d)) ^ (digest * 31);
+    if (memcmp(&d, &last, sizeof(d)) != 0) {
+      last = d;
+      changes++;
+      print(f.ms, &d);
+    }
+  }
+  fclose(in);
+  for (int ic = 0; ic < TOTAL_IC; ic++) {
+    emu[ic].bad_groups = 0;
+  }
+  emu_noise = true;
+  host_hold_clock(false);
+  manual_fault = false;
+  char line[] = "mode idle";  // back from the log, start from rest
+  console_exec(line);
+  host_printf("Replayed %lu frames, %lu decision changes, digest %08lX\n",
+              (unsigned long)frames, (unsigned long)changes,
+              (unsigned long)digest);
+  return true;
+}
+
+void replay_command(int argc, char **argv) {
+  if (argc == 2) {
+    replay_run(argv[1]);
+  } else {
+    host_printf("replay <file>\n");
+  }
+}
@@ -0,0 +1,19 @@
+// Replay of an SD log of the sketch (`log start`) in the host build. Each
+// frame goes back in through what the sketch measures: the codes become
+// the inputs of emu[], stale channels fail their PEC on every read, the
+// current goes to A0 and the request and manual fault to the console. The
+// sketch then runs one cycle on it, on a held clock that follows the log,
+// so the same fault, balancing, charging and state machine code decides.
+#ifndef HOST_REPLAY_H
+#define HOST_REPLAY_H
+
+#include <stdint.h>
+
+// Every frame of the log, false if it can't be opened. Prints an `R` line
+// for each cycle whose decisions changed and the digest of all of them.
+bool replay_run(const char *path);
+
+// `replay <file>`, see host_command()
+void replay_command(int argc, char **argv);
+
+#endif  // HOST_REPLAY_H
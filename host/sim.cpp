@@ -0,0 +1,267 @@
+// Pack model of the host build, see sim.h
+#include "sim.h"
+
+#include "emulator.h"
+#include "host.h"
+
+// The sketch's state, the load only runs while driving
+extern uint8_t state;
+
+namespace {
+
+const uint8_t ST_DRIVE = 2;            // bms_state of the sketch
+const float CELL_CAPACITY_AH = 3.0;    // as in the sketch
+const float BLEED_RESISTOR = 33.0;     // as in the sketch, ohm
+const uint32_t PACK_CURRENT_PIN = A0;  // as in the sketch
+const float CURRENT_SENSOR_OFFSET = 1.65;
+const float CURRENT_SENSOR_GAIN = 0.0066;
+const uint32_t ID_CHARGER_REQ = 0x1806E5F4;  // 29 bit, as in the sketch
+const uint32_t ID_CHARGER_STAT = 0x18FF50E5;
+// Rest voltage at 0%, 10%, ..., 100% state of charge, as OCV_TABLE of the
+// sketch, so the model and its SoC estimate agree
+const uint16_t OCV_TABLE[11] = {30000, 34500, 35500, 36200, 36800, 37400,
+                                38200, 39100, 39900, 40800, 42000};
+
+const uint32_t SIM_STEP_MS = 100;
+const float SIM_CAPACITY_SPREAD = 0.03;  // +- relative to CELL_CAPACITY_AH
+const float SIM_R_OHM = 0.004;           // cell (parallel group) resistance
+const float SIM_R_SPREAD = 0.15;         // +- relative, per cell
+const float SIM_LEAK_A = 0.00002;        // self-discharge, about 3 %/month
+const float SIM_LEAK_SPREAD = 0.5;       // +- relative, per cell
+const float SIM_MODULE_J_K = 9000.0;     // heat capacity of a 12 cell module
+const float SIM_MODULE_K_W = 1.5;        // module to air
+const float SIM_DIE_K_W = 8.0;           // LTC6811 die per W bled on the board
+const float SIM_CHARGER_V = 600.0;       // charger stand-in limits
+const float SIM_CHARGER_A = 20.0;
+
+typedef struct {
+  float soc;     // 0..1
+  float cap_as;  // capacity, As
+  float r_ohm;
+  float leak_a;
+} sim_cell;
+typedef struct {
+  uint16_t seconds;
+  float amps;  // out of the pack, negative for regen
+} sim_segment;
+// One endurance lap, about a minute at 6 A average, so 22 laps take close
+// to 80 % of CELL_CAPACITY_AH
+const sim_segment SIM_LAP[] = {
+    {8, 12}, {4, -4}, {6, 8}, {3, -2}, {10, 15},
+    {5, -5}, {7, 6}, {4, 1}, {9, 11}, {5, -2},
+};
+
+bool running = false;  // sim_init() was called
+sim_cell cells[EMU_ICS][EMU_CELLS];
+float module_c[EMU_ICS];
+float ambient_c = 25.0;
+float charger_a = 0;  // into the pack
+float drive_a = 0;    // constant drive load when no race is running
+uint16_t laps = 0;    // race laps still to go
+uint32_t lap_ms = 0;  // position in the current lap
+bool plugged = false;  // charger stand-in connected
+uint32_t step_ms = 0;  // millis() of the last step
+uint32_t start_ms = 0;
+float charged_ah = 0;
+float bled_ah = 0;
+
+float spread(float rel) { return 1 + rel * ((emu_rand() % 2001) / 1000.0 - 1); }
+
+float ocv(float soc) {
+  float x = constrain(soc, 0, 1) * 10;
+  int i = min((int)x, 9);
+  return (OCV_TABLE[i] + (OCV_TABLE[i + 1] - OCV_TABLE[i]) * (x - i)) *
+         0.0001;
+}
+
+void put_u16_be(uint8_t *data, uint16_t value) {
+  data[0] = value >> 8;
+  data[1] = value & 0xFF;
+}
+
+void charger() {
+  if (!plugged) {
+    charger_a = 0;
+    return;
+  }
+  // The latest request the BMS put on the bus, answered like the charger
+  std::vector<host_can_frame> &sent = host_can_sent();
+  float volts = 0;
+  float amps = 0;
+  for (size_t i = sent.size(); i-- > 0;) {
+    const host_can_frame &f = sent[i];
+    if (f.ext && f.id == ID_CHARGER_REQ) {
+      volts = ((f.data[0] << 8) | f.data[1]) * 0.1;
+      amps = f.data[4] != 0 ? 0 : ((f.data[2] << 8) | f.data[3]) * 0.1;
+      break;
+    }
+  }
+  float v = 0;
+  float r = 0;
+  for (int ic = 0; ic < EMU_ICS; ic++) {
+    for (int i = 0; i < EMU_CELLS; i++) {
+      v += ocv(cells[ic][i].soc);
+      r += cells[ic][i].r_ohm;
+    }
+  }
+  // Its own CV loop keeps the output at the requested voltage
+  amps = min(min(amps, SIM_CHARGER_A), max(0.0f, (volts - v) / r));
+  amps = min(amps, (SIM_CHARGER_V - v) / r);
+  charger_a = max(0.0f, amps);
+
+  host_can_frame status = {ID_CHARGER_STAT, true, 8, {0}};
+  put_u16_be(&status.data[0], (v + charger_a * r) * 10);
+  put_u16_be(&status.data[2], charger_a * 10);
+  host_can_send(status);
+}
+
+float load(uint32_t dt_ms) {
+  if (laps == 0) {
+    return drive_a;
+  }
+  uint32_t lap_len = 0;
+  const uint8_t N = sizeof(SIM_LAP) / sizeof(SIM_LAP[0]);
+  for (int i = 0; i < N; i++) {
+    lap_len += SIM_LAP[i].seconds * 1000;
+  }
+  uint32_t pos = lap_ms;
+  lap_ms += dt_ms;
+  if (lap_ms >= lap_len) {
+    lap_ms -= lap_len;
+    if (--laps == 0) {
+      host_printf("Race finished\n");
+    }
+  }
+  for (int i = 0; i < N; i++) {
+    if (pos < SIM_LAP[i].seconds * 1000UL) {
+      return SIM_LAP[i].amps;
+    }
+    pos -= SIM_LAP[i].seconds * 1000UL;
+  }
+  return 0;
+}
+
+void step(uint32_t dt_ms) {
+  float dt = dt_ms / 1000.0;
+  charger();
+  float pack_a = charger_a;  // into the pack
+  if (state == ST_DRIVE) {
+    pack_a -= load(dt_ms);
+  }
+  charged_ah += charger_a * dt / 3600;
+  // What the Hall sensor puts on the ADC
+  float sensor_v = CURRENT_SENSOR_OFFSET + pack_a * CURRENT_SENSOR_GAIN;
+  host_analog(PACK_CURRENT_PIN,
+              constrain(sensor_v / 3.3 * 4095 + 0.5, 0, 4095));
+
+  uint32_t now = emu_us();
+  for (int ic = 0; ic < EMU_ICS; ic++) {
+    emu_ic *e = &emu[ic];
+    float heat_w = 0;
+    float bleed_w = 0;
+    for (int i = 0; i < EMU_CELLS; i++) {
+      sim_cell *c = &cells[ic][i];
+      float v = ocv(c->soc);
+      // DCC while the watchdog runs, the PWM register once it has expired
+      float bleed_a = v / BLEED_RESISTOR * emu_s_duty(ic, i, now);
+      float cell_a = pack_a - bleed_a - c->leak_a;
+      c->soc = constrain(c->soc + cell_a * dt / c->cap_as, 0, 1);
+      heat_w += pack_a * pack_a * c->r_ohm;
+      bleed_w += bleed_a * v;
+      bled_ah += bleed_a * dt / 3600;
+      // The bleeding cell is what the ADC sees through the sense wires
+      e->cell_in[i] = constrain((v + pack_a * c->r_ohm) * 10000, 0, 65535);
+    }
+    float *t = &module_c[ic];
+    *t += (heat_w - (*t - ambient_c) / SIM_MODULE_K_W) * dt / SIM_MODULE_J_K;
+    for (int i = 0; i < EMU_GPIOS; i++) {
+      // Sensors nearer the busbars run a bit warmer
+      e->gpio_in[i] = emu_ntc_code(*t + 0.5 * i * (*t - ambient_c) / 10);
+    }
+    e->die_c = ambient_c + 5 + bleed_w * SIM_DIE_K_W;
+  }
+}
+
+void tick() {
+  uint32_t dt_ms = millis() - step_ms;
+  if (dt_ms >= SIM_STEP_MS) {
+    step_ms += dt_ms;
+    step(dt_ms);
+  }
+}
+
+void status() {
+  float lo = 1, hi = 0, hot = -100;
+  for (int ic = 0; ic < EMU_ICS; ic++) {
+    for (int i = 0; i < EMU_CELLS; i++) {
+      lo = min(lo, cells[ic][i].soc);
+      hi = max(hi, cells[ic][i].soc);
+    }
+    hot = max(hot, module_c[ic]);
+  }
+  host_printf(
+      "Simulated %lu s, SoC %.2f..%.2f %%, hottest module %.1f C, "
+      "charged %.2f Ah, bled %.3f Ah, laps to go %u\n",
+      (millis() - start_ms) / 1000, lo * 100, hi * 100, hot, charged_ah,
+      bled_ah, laps);
+}
+
+}  // namespace
+
+void sim_init(float soc, float spread_rel) {
+  for (int ic = 0; ic < EMU_ICS; ic++) {
+    for (int i = 0; i < EMU_CELLS; i++) {
+      sim_cell *c = &cells[ic][i];
+      c->soc = constrain(soc * spread(spread_rel), 0, 1);
+      c->cap_as = CELL_CAPACITY_AH * 3600 * spread(SIM_CAPACITY_SPREAD);
+      c->r_ohm = SIM_R_OHM * spread(SIM_R_SPREAD);
+      c->leak_a = SIM_LEAK_A * spread(SIM_LEAK_SPREAD);
+    }
+    module_c[ic] = ambient_c;
+  }
+  charged_ah = 0;
+  bled_ah = 0;
+  start_ms = millis();
+  step_ms = start_ms;
+  step(0);  // inputs valid before the first conversion
+  running = true;
+  host_on_tick(tick);
+}
+
+void sim_stop() {
+  running = false;
+  host_on_tick(NULL);
+}
+
+void sim_command(int argc, char **argv) {
+  const char *what = argc >= 2 ? argv[1] : "status";
+  long value, spread_pct;
+  if (!running && strcmp(what, "soc") != 0) {
+    host_printf("The pack model is off, start it with sim soc\n");
+  } else if (strcmp(what, "soc") == 0 && argc >= 3 &&
+      host_num(argv[2], 0, 100, &value)) {
+    spread_pct = 2;
+    if (argc < 4 || host_num(argv[3], 0, 50, &spread_pct)) {
+      sim_init(value / 100.0, spread_pct / 100.0);
+    }
+  } else if (strcmp(what, "load") == 0 && argc == 3 &&
+             host_num(argv[2], -200, 400, &value)) {
+    drive_a = value;
+    laps = 0;
+  } else if (strcmp(what, "race") == 0 && argc == 3 &&
+             host_num(argv[2], 0, 1000, &value)) {
+    laps = value;
+    lap_ms = 0;
+    host_console("mode drive");
+  } else if (strcmp(what, "charger") == 0 && argc == 3) {
+    plugged = strcmp(argv[2], "on") == 0;
+  } else if (strcmp(what, "ambient") == 0 && argc == 3 &&
+             host_num(argv[2], -20, 60, &value)) {
+    ambient_c = value;
+  } else if (strcmp(what, "status") == 0) {
+    status();
+  } else {
+    host_printf("sim status | soc <%%> [spread %%] | load <A>\n");
+    host_printf("    race <laps> | charger on|off | ambient <deg C>\n");
+  }
+}
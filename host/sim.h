@@ -0,0 +1,16 @@
+// Pack model of the host build. Every cell has its own capacity, resistance
+// and self-discharge and bleeds while its S pin is on, each module heats up
+// with I²R. It steps on the host clock and drives what the sketch measures:
+// the cell and NTC inputs of emu[], the current sensor on A0 and a charger
+// on the CAN bus that answers the requests of the BMS.
+#ifndef HOST_SIM_H
+#define HOST_SIM_H
+
+// Starts the model, every cell at soc (0..1) +- spread (relative)
+void sim_init(float soc, float spread);
+void sim_stop();  // leaves the inputs where they are
+
+// `sim status|soc|load|race|charger|ambient`, see host_command()
+void sim_command(int argc, char **argv);
+
+#endif  // HOST_SIM_H
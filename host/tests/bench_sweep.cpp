@@ -0,0 +1,37 @@
+// bench_sweep(): one CSV row per chain length, MD, SPI rate and strategy,
+// the SPI rates being what the dividers of SPI_DIV_LADDER give at 84 MHz.
+#include <set>
+#include <sstream>
+#include <string>
+
+#include "bench.h"
+#include "host.h"
+
+int main() {
+  host_setup();
+  host_loops(1);
+  host_clear_output();
+  bench_sweep(10);
+  std::istringstream csv(host_output());
+  std::string line;
+  std::set<int> khz;
+  int rows = 0;
+  bool header = false;
+  while (std::getline(csv, line)) {
+    header |= line.find("ics,md,spi_khz,strategy") == 0;
+    int ics, md, rate;
+    char strategy[16];
+    float conv, bus, cpu, hz, pct;
+    if (sscanf(line.c_str(), "%d,%d,%d,%15[^,],%f,%f,%f,%f,%f", &ics, &md,
+               &rate, strategy, &conv, &bus, &cpu, &hz, &pct) == 9) {
+      rows++;
+      khz.insert(rate);
+      HOST_CHECK(ics == 10 && hz > 0 && pct > 0 && pct < 100);
+    }
+  }
+  HOST_CHECK(header);
+  HOST_CHECK(rows == 4 * 3 * 3);  // MD x SPI level x strategy
+  HOST_CHECK(khz.size() == 3);
+  HOST_CHECK(khz.count(1000) && khz.count(500) && khz.count(329));
+  return host_report("bench_sweep");
+}
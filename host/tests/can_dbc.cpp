@@ -0,0 +1,364 @@
+// The CAN frames against bms_can.dbc: every frame the BMS sends is in the
+// DBC with its length and decodes to values inside the declared ranges and
+// equal to what the sketch measured, and frames encoded from the DBC (the
+// ECU's commands, the charger's status) do what the DBC says they do.
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "LTC681x.h"
+#include "host.h"
+
+extern cell_asic BMS_IC[];
+extern float bal_eta_h;
+
+namespace {
+
+const int TOTAL_IC = 10;  // as in the sketch
+
+struct dbc_signal {
+  std::string name;
+  int mux;  // -1 always present, -2 the multiplexer, else its value
+  int start;
+  int length;
+  bool intel;
+  bool is_signed;
+  double factor;
+  double offset;
+  double min;
+  double max;
+};
+
+struct dbc_message {
+  std::string name;
+  uint32_t id;
+  bool ext;
+  uint8_t dlc;
+  std::string sender;
+  std::vector<dbc_signal> signals;
+};
+
+std::vector<dbc_message> dbc;
+
+// BO_ and SG_ lines only, which is all the frames need
+bool dbc_load(const char *path) {
+  std::ifstream in(path);
+  std::string line;
+  while (std::getline(in, line)) {
+    std::istringstream s(line);
+    std::string tag;
+    s >> tag;
+    if (tag == "BO_") {
+      dbc_message m;
+      uint32_t id;
+      std::string dlc;
+      s >> id >> m.name >> dlc >> m.sender;
+      m.name.erase(m.name.size() - 1);  // the ':'
+      m.ext = id & 0x80000000;
+      m.id = id & 0x1FFFFFFF;
+      m.dlc = atoi(dlc.c_str());
+      dbc.push_back(m);
+    } else if (tag == "SG_" && !dbc.empty()) {
+      dbc_signal g;
+      std::string mux, colon, layout, scale, range;
+      s >> g.name >> mux;
+      if (mux == ":") {
+        g.mux = -1;
+      } else {
+        g.mux = mux == "M" ? -2 : atoi(mux.c_str() + 1);
+        s >> colon;
+      }
+      s >> layout >> scale >> range;
+      char order, sign;
+      sscanf(layout.c_str(), "%d|%d@%c%c", &g.start, &g.length, &order, &sign);
+      sscanf(scale.c_str(), "(%lf,%lf)", &g.factor, &g.offset);
+      sscanf(range.c_str(), "[%lf|%lf]", &g.min, &g.max);
+      g.intel = order == '1';
+      g.is_signed = sign == '-';
+      dbc.back().signals.push_back(g);
+    }
+  }
+  return !dbc.empty();
+}
+
+const dbc_message *dbc_find(uint32_t id, bool ext) {
+  for (size_t i = 0; i < dbc.size(); i++) {
+    if (dbc[i].id == id && dbc[i].ext == ext) {
+      return &dbc[i];
+    }
+  }
+  return NULL;
+}
+
+const dbc_message *dbc_find(const char *name) {
+  for (size_t i = 0; i < dbc.size(); i++) {
+    if (dbc[i].name == name) {
+      return &dbc[i];
+    }
+  }
+  return NULL;
+}
+
+// Bit k of the raw value, LSB first, in the frame's bit numbering. Motorola
+// signals start at their MSB and run down through each byte, then on to the
+// next byte.
+int dbc_bit(const dbc_signal &g, int k) {
+  if (g.intel) {
+    return g.start + k;
+  }
+  int bit = g.start;
+  for (int i = g.length - 1; i > k; i--) {
+    bit = bit % 8 == 0 ? bit + 15 : bit - 1;
+  }
+  return bit;
+}
+
+double decode(const dbc_signal &g, const uint8_t *data) {
+  uint64_t raw = 0;
+  for (int k = 0; k < g.length; k++) {
+    int bit = dbc_bit(g, k);
+    raw |= (uint64_t)((data[bit / 8] >> (bit % 8)) & 1) << k;
+  }
+  int64_t value = raw;
+  if (g.is_signed && (raw >> (g.length - 1)) & 1) {
+    value = raw - (1ULL << g.length);
+  }
+  return value * g.factor + g.offset;
+}
+
+void encode(const dbc_signal &g, double physical, uint8_t *data) {
+  int64_t value = llround((physical - g.offset) / g.factor);
+  for (int k = 0; k < g.length; k++) {
+    int bit = dbc_bit(g, k);
+    data[bit / 8] &= ~(1 << (bit % 8));
+    data[bit / 8] |= ((value >> k) & 1) << (bit % 8);
+  }
+}
+
+// Signal name -> value of one frame, the multiplexed ones only if present
+std::map<std::string, double> decode_all(const dbc_message &m,
+                                         const uint8_t *data) {
+  std::map<std::string, double> values;
+  int mux = -1;
+  for (size_t i = 0; i < m.signals.size(); i++) {
+    if (m.signals[i].mux == -2) {
+      mux = decode(m.signals[i], data);
+    }
+  }
+  for (size_t i = 0; i < m.signals.size(); i++) {
+    const dbc_signal &g = m.signals[i];
+    if (g.mux < 0 || g.mux == mux) {
+      values[g.name] = decode(g, data);
+    }
+  }
+  return values;
+}
+
+host_can_frame frame_of(const char *name,
+                        const std::map<std::string, double> &values) {
+  const dbc_message *m = dbc_find(name);
+  host_can_frame frame = {m->id, m->ext, m->dlc, {0}};
+  for (size_t i = 0; i < m->signals.size(); i++) {
+    std::map<std::string, double>::const_iterator v =
+        values.find(m->signals[i].name);
+    if (v != values.end()) {
+      encode(m->signals[i], v->second, frame.data);
+    }
+  }
+  return frame;
+}
+
+// The last frame the BMS sent of a message, decoded
+std::map<std::string, double> last(const char *name, int page = -1) {
+  const dbc_message *m = dbc_find(name);
+  std::vector<host_can_frame> &sent = host_can_sent();
+  for (size_t i = sent.size(); m && i-- > 0;) {
+    if (sent[i].id == m->id && sent[i].ext == m->ext &&
+        (page < 0 || sent[i].data[0] == page)) {
+      return decode_all(*m, sent[i].data);
+    }
+  }
+  return std::map<std::string, double>();
+}
+
+bool near(double a, double b, double tolerance) {
+  return fabs(a - b) <= tolerance;
+}
+
+// "<index> <name> = <value>" from `config show`
+int config_index(const char *name) {
+  std::string key = std::string(" ") + name + " = ";
+  const std::string &out = host_output();
+  size_t at = out.rfind(key);
+  if (at == std::string::npos) {
+    return -1;
+  }
+  size_t line = out.rfind('\n', at);
+  return atoi(out.c_str() + (line == std::string::npos ? 0 : line + 1));
+}
+
+}  // namespace
+
+int main() {
+  HOST_CHECK(dbc_load(BMS_DBC));
+  host_setup();
+  host_loops(4);
+
+  // Every frame on the bus is in the DBC, sent by the BMS, with its DLC,
+  // and every signal it carries is inside its declared range
+  std::map<uint32_t, bool> seen;
+  for (size_t i = 0; i < host_can_sent().size(); i++) {
+    const host_can_frame &f = host_can_sent()[i];
+    const dbc_message *m = dbc_find(f.id, f.ext);
+    HOST_CHECK(m != NULL);
+    if (m == NULL) {
+      continue;
+    }
+    seen[m->id] = true;
+    HOST_CHECK(m->sender == "BMS" && f.dlc == m->dlc);
+    std::map<std::string, double> values = decode_all(*m, f.data);
+    for (size_t k = 0; k < m->signals.size(); k++) {
+      const dbc_signal &g = m->signals[k];
+      if (values.count(g.name) &&
+          (values[g.name] < g.min || values[g.name] > g.max)) {
+        printf("%s %s = %g outside [%g|%g]\n", m->name.c_str(),
+               g.name.c_str(), values[g.name], g.min, g.max);
+        host_failures++;
+      }
+    }
+  }
+  for (size_t i = 0; i < dbc.size(); i++) {
+    HOST_CHECK(dbc[i].sender != "BMS" || seen.count(dbc[i].id));
+  }
+
+  // The values are the sketch's own
+  std::map<std::string, double> status = last("BMS_Status");
+  HOST_CHECK(status["State"] == 2);  // DRIVE
+  HOST_CHECK(status["Fault"] == -1);
+  HOST_CHECK(status["FaultActive"] == 0);
+  uint16_t lo = 0xFFFF;
+  uint16_t hi = 0;
+  for (int ic = 0; ic < TOTAL_IC; ic++) {
+    for (int i = 0; i < 12; i++) {
+      uint16_t code = BMS_IC[ic].cells.c_codes[i];
+      lo = code < lo ? code : lo;
+      hi = code > hi ? code : hi;
+    }
+  }
+  std::map<std::string, double> summary = last("BMS_PackSummary");
+  HOST_CHECK(near(summary["CellMin"], lo * 0.0001, 0.00005));
+  HOST_CHECK(near(summary["CellMax"], hi * 0.0001, 0.00005));
+  for (int page = 0; page < TOTAL_IC * 12 / 3; page++) {
+    std::map<std::string, double> cells = last("BMS_CellVoltages", page);
+    for (int k = 0; k < 3; k++) {
+      int cell = page * 3 + k;
+      char name[8];
+      snprintf(name, sizeof(name), "Cell%03d", cell + 1);
+      HOST_CHECK(cells.count(name) == 1);
+      // A page may have gone out before the last conversion, which differs
+      // by the emulated ADC noise
+      uint16_t code = BMS_IC[cell / 12].cells.c_codes[cell % 12];
+      HOST_CHECK(near(cells[name], code * 0.0001, 0.001));
+    }
+    HOST_CHECK(cells["CellValid"] == 7);
+  }
+  // The default bypass list drops NTC 5 of IC 8
+  HOST_CHECK(last("BMS_Temperatures", 5)["Temp40"] == -128);
+  HOST_CHECK(near(last("BMS_Temperatures", 0)["Temp01"], 25, 3));
+  HOST_CHECK(last("BMS_Limits")["ChargeDerate"] == 100);
+
+  // BMS_Command and BMS_ConfigSet as the ECU would encode them
+  std::map<std::string, double> command;
+  command["Request"] = 3;  // BALANCE
+  host_can_send(frame_of("BMS_Command", command));
+  HOST_CHECK(host_loops_until("IDLE -> BALANCE_ONLY", 3));
+  host_loops(4);
+  HOST_CHECK(last("BMS_Balance")["BalanceEta"] == (int)(bal_eta_h * 60 + 0.5));
+  command["Request"] = 255;  // keep
+  command["ClearFault"] = 0;
+  host_can_send(frame_of("BMS_Command", command));
+  host_clear_output();
+  host_loops(2);
+  HOST_CHECK(!host_printed("->"));
+
+  host_console("config show");
+  host_loops(1);
+  int params = 0;
+  size_t at = 0;
+  while ((at = host_output().find(" = ", at + 1)) != std::string::npos) {
+    params++;
+  }
+  const dbc_message *set = dbc_find("BMS_ConfigSet");
+  HOST_CHECK(set->signals[0].name == "ParamIndex");
+  HOST_CHECK(set->signals[0].max == params - 1);
+  int vmax = config_index("vmax");
+  int end_a = config_index("end_a");
+  HOST_CHECK(vmax >= 0 && end_a >= 0);
+  std::map<std::string, double> config;
+  config["ParamIndex"] = vmax;
+  config["Value"] = 43000;
+  host_can_send(frame_of("BMS_ConfigSet", config));
+  config["ParamIndex"] = end_a;
+  config["Value"] = 750;  // thousandths
+  host_can_send(frame_of("BMS_ConfigSet", config));
+  host_loops(1);
+  host_clear_output();
+  host_console("config show");
+  host_loops(1);
+  HOST_CHECK(host_printed(" vmax = 43000"));
+  HOST_CHECK(host_printed(" end_a = 0.750"));
+
+  // ClearFault leaves FAULT_LATCHED only once the cause is gone, and a
+  // second one within CAN_CLEAR_MS is not taken
+  config["ParamIndex"] = config_index("temp_max");
+  config["Value"] = 20;  // every NTC over temperature
+  host_can_send(frame_of("BMS_ConfigSet", config));
+  HOST_CHECK(host_loops_until("-> FAULT_LATCHED", 40));
+  command["ClearFault"] = 1;
+  host_can_send(frame_of("BMS_Command", command));
+  uint32_t cleared = millis();
+  host_clear_output();
+  host_loops(1);
+  HOST_CHECK(!host_printed("->"));
+  HOST_CHECK(last("BMS_Status")["State"] == 6);  // FAULT_LATCHED
+  config["Value"] = 60;
+  host_can_send(frame_of("BMS_ConfigSet", config));
+  host_can_send(frame_of("BMS_Command", command));
+  host_loops(2);
+  HOST_CHECK(!host_printed("->"));
+  // A loop takes a few hundred ms of the simulated clock
+  while (millis() - cleared < 1500) {
+    host_loops(1);
+  }
+  host_can_send(frame_of("BMS_Command", command));
+  HOST_CHECK(host_loops_until("FAULT_LATCHED -> IDLE", 2));
+
+  // The charger's status from the DBC brings it online but requests
+  // nothing. With CHARGE requested too it is asked for what BMS_Limits
+  // reports.
+  std::map<std::string, double> charger;
+  charger["OutputVoltage"] = 450.0;
+  charger["OutputCurrent"] = 0;
+  for (int i = 0; i < 6; i++) {
+    host_can_send(frame_of("CHARGER_Status", charger));
+    host_loops(1);
+  }
+  HOST_CHECK(host_printed("Charger connected"));
+  HOST_CHECK(last("BMS_Status")["State"] != 3);
+  HOST_CHECK(last("CHARGER_Request")["Stop"] == 1);
+  host_console("mode charge");
+  for (int i = 0; i < 12; i++) {
+    host_can_send(frame_of("CHARGER_Status", charger));
+    host_loops(1);
+  }
+  HOST_CHECK(last("BMS_Status")["State"] == 3);  // CHARGE
+  std::map<std::string, double> request = last("CHARGER_Request");
+  std::map<std::string, double> limits = last("BMS_Limits");
+  HOST_CHECK(request["Stop"] == 0);
+  HOST_CHECK(request["MaxCurrent"] > 0);
+  HOST_CHECK(near(request["MaxCurrent"], limits["ChargeLimit"], 0.05));
+  HOST_CHECK(near(request["MaxVoltage"], limits["ChargeVoltage"], 0.05));
+  return host_report("can_dbc");
+}
@@ -0,0 +1,77 @@
+// The read and parse path of the sketch, LTC681x.cpp and bms_hardware.cpp
+// against the emulated chain: conversions, register reads, PEC checks and
+// the recovery of a group that keeps failing them.
+#include "LTC681x.h"
+#include "host.h"
+
+extern cell_asic BMS_IC[];
+extern uint16_t good_cells[][12];
+extern uint16_t good_aux[][6];
+extern uint8_t cell_groups_read[];
+extern uint8_t aux_groups_read[];
+
+namespace {
+
+const int TOTAL_IC = 10;  // as in the sketch
+const int NOISE = 8;      // codes, the most the emulated ADC adds in any MD
+
+bool near(uint16_t code, int expected, int tolerance) {
+  return abs((int)code - expected) <= tolerance;
+}
+
+}  // namespace
+
+int main() {
+  host_setup();
+  host_loops(2);
+  for (int ic = 0; ic < TOTAL_IC; ic++) {
+    for (int i = 0; i < 12; i++) {
+      HOST_CHECK(near(BMS_IC[ic].cells.c_codes[i], 37000, 300 + NOISE));
+      HOST_CHECK(BMS_IC[ic].cells.pec_match[i / 3] == 0);
+    }
+  }
+
+  // A cell input makes it through conversion, RDCVx and parse_cells()
+  host_command("emu cell 3 5 33000");
+  host_command("emu cell 9 12 41500");
+  host_loops(2);
+  HOST_CHECK(near(BMS_IC[3].cells.c_codes[4], 33000, NOISE));
+  HOST_CHECK(near(BMS_IC[9].cells.c_codes[11], 41500, NOISE));
+
+  // NTC inputs through ADAX and RDAUXx, hotter reads lower
+  uint16_t warm = BMS_IC[1].aux.a_codes[0];
+  host_command("emu temp 1 0 60");
+  host_loops(2);
+  HOST_CHECK(BMS_IC[1].aux.a_codes[0] < warm - 1000);
+  HOST_CHECK(near(BMS_IC[1].aux.a_codes[5], 30000, 0));  // REF2
+
+  // Every frame of IC 4 fails PEC: its codes stay at the last good read
+  // and the sketch raises the stale data fault once it ran on them too long
+  uint16_t kept = BMS_IC[4].cells.c_codes[0];
+  host_command("emu cell 4 1 30000");
+  host_command("emu pec 4 1000");
+  HOST_CHECK(host_loops_until("Stale data", 20));
+  HOST_CHECK(BMS_IC[4].cells.c_codes[0] == kept);
+  HOST_CHECK(BMS_IC[4].cells.pec_match[0] != 0);
+
+  host_command("emu pec 4 0");
+  host_loops(2);
+  HOST_CHECK(near(BMS_IC[4].cells.c_codes[0], 30000, NOISE));
+  HOST_CHECK(BMS_IC[4].cells.pec_match[0] == 0);
+
+  // The same from boot, before IC 4 ever passed PEC: there are no last good
+  // codes, so it is stale data at once instead of 0 V and a voltage fault
+  host_loops_until("FAULT_RECOVERABLE -> IDLE", 30);
+  host_clear_output();
+  host_command("emu pec 4 1000");
+  host_loops(1);
+  memset(good_cells[4], 0, sizeof(good_cells[4]));
+  memset(good_aux[4], 0, sizeof(good_aux[4]));
+  cell_groups_read[4] = 0;
+  aux_groups_read[4] = 0;
+  host_loops(2);
+  HOST_CHECK(host_printed("-> FAULT_RECOVERABLE"));
+  host_loops(2);
+  HOST_CHECK(!host_printed("FAULT_LATCHED"));
+  return host_report("chain_read");
+}
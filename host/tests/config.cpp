@@ -0,0 +1,71 @@
+// Thresholds that only make sense in a certain order: a `set` or
+// BMS_ConfigSet that breaks it is refused and changes nothing, and a CRC
+// valid flash page that breaks it falls back to the defaults.
+#include "host.h"
+
+uint8_t *config_page(uint8_t page);
+uint32_t crc32(const uint8_t *data, uint32_t length);
+void config_load();
+
+int main() {
+  host_setup();
+  host_loops(1);
+
+  host_console("set vmin 34000");
+  host_console("set vmax 41000");  // below cv
+  host_console("set chg_tmin 15");
+  host_console("set temp_min 20");
+  host_console("set temp_max 20");
+  host_loops(1);
+  HOST_CHECK(host_printed("Not set, needs vmin < charged"));
+  HOST_CHECK(host_printed("Not set, needs chg_tmin < chg_tcold <= chg_thot"));
+  HOST_CHECK(host_printed("Not set, needs temp_min < temp_max"));
+  host_clear_output();
+  host_console("config show");
+  host_loops(1);
+  HOST_CHECK(host_printed(" vmin = 34000"));
+  HOST_CHECK(host_printed(" vmax = 42000"));
+  HOST_CHECK(host_printed(" chg_tmin = 0"));
+  HOST_CHECK(host_printed(" temp_min = 20"));
+  HOST_CHECK(host_printed(" temp_max = 60"));
+
+  // BMS_ConfigSet goes through the same check: index 0 is vmax
+  host_can_frame set = {0x611, false, 6, {0, 0x10, 0x9F, 0, 0, 1}};  // 40720
+  host_can_send(set);
+  host_clear_output();
+  host_loops(1);
+  HOST_CHECK(host_printed("Not set, needs vmin < charged"));
+
+  // A page saved by an older build without the checks
+  host_console("config save");
+  host_loops(1);
+  uint8_t *page = NULL;
+  uint16_t length = 0;
+  for (uint8_t p = 0; p < 2; p++) {
+    uint8_t *at = config_page(p);
+    uint16_t n = at[2] | (at[3] << 8);
+    uint32_t crc = 0;
+    if (n > 4 && n <= 256) {
+      memcpy(&crc, &at[n - 4], 4);
+    }
+    if (n > 4 && n <= 256 && crc == crc32(at, n - 4)) {
+      page = at;
+      length = n;
+    }
+  }
+  HOST_CHECK(page != NULL);
+  if (page == NULL) {
+    return host_report("config");
+  }
+  page[10] = 43000 & 0xFF;  // vmin_code, right after vmax_code
+  page[11] = 43000 >> 8;
+  uint32_t crc = crc32(page, length - 4);
+  memcpy(&page[length - 4], &crc, 4);
+  host_clear_output();
+  config_load();
+  host_console("config show");
+  host_loops(1);
+  HOST_CHECK(host_printed("Config: needs vmin < charged"));
+  HOST_CHECK(host_printed(" vmin = 25000"));
+  return host_report("config");
+}
@@ -0,0 +1,21 @@
+// A line longer than the console ring is dropped as a whole: nothing of its
+// tail runs as a command, and the next line works as usual.
+#include <string>
+
+#include "host.h"
+
+int main() {
+  host_setup();
+  host_loops(1);
+
+  std::string line(200, ' ');
+  line += "fault";
+  host_console(line.c_str());
+  host_console("mode idle");
+  host_clear_output();
+  host_loops(2);
+  HOST_CHECK(host_printed("Line too long, dropped"));
+  HOST_CHECK(!host_printed("FAULT"));
+  HOST_CHECK(host_printed("-> IDLE"));
+  return host_report("console");
+}
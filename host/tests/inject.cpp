@@ -0,0 +1,157 @@
+// Timed fault scenarios on the emulated chain: each one breaks the chain in
+// one of the ways the car can, from a healthy pack and a cleared fault, and
+// has to drop BMS_FAULT_PIN within its latency budget, timed from the cycle
+// the fault is really there to the pin write. A change that slows the fault
+// reaction down fails here instead of on the bench.
+#include "emulator.h"
+#include "host.h"
+
+extern uint8_t state;
+
+namespace {
+
+const uint32_t FAULT_PIN = 2;         // BMS_FAULT_PIN
+const uint8_t ST_FAULT_LATCHED = 6;   // bms_state of the sketch
+const uint16_t VMAX_CODE = 42000;     // as in the sketch
+const uint16_t VMIN_CODE = 25000;
+const uint16_t RAMP_START = 1000;     // codes short of the threshold
+const uint16_t RAMP_STEP = 100;       // codes per cycle, 10 mV
+const uint16_t SETTLE_CYCLES = 25;    // fault free cycles before a scenario
+const uint32_t MAX_CYCLES = 200;      // per scenario, settling included
+
+// One scenario. apply() runs once per cycle from step 0 and returns true
+// from the cycle on which the fault is really there, which is when the
+// latency budget starts.
+typedef struct {
+  const char *name;
+  bool (*apply)(uint16_t step);
+  uint32_t budget_ms;  // millis() from the fault to BMS_FAULT_PIN LOW
+} scenario;
+
+bool ramp(uint16_t step, int8_t dir) {
+  // Cell 1 of IC 0 towards vmax or vmin, kept going past the threshold as
+  // a real one would instead of sitting on it in the ADC noise
+  emu_ic *e = &emu[0];
+  uint16_t target = dir > 0 ? VMAX_CODE : VMIN_CODE;
+  if (step == 0) {
+    e->cell_bias[0] = target - e->cell_in[0] - dir * RAMP_START;
+  }
+  e->cell_bias[0] += dir * RAMP_STEP;
+  int32_t in = e->cell_in[0] + e->cell_bias[0];
+  return dir > 0 ? in >= target : in <= target;
+}
+
+bool ov(uint16_t step) { return ramp(step, 1); }
+
+bool uv(uint16_t step) { return ramp(step, -1); }
+
+bool ntc_open(uint16_t step) {
+  emu[0].ntc_open = 0x01;
+  return true;
+}
+
+bool open_wire(uint16_t step) {
+  emu[0].open_wire = 1 << 5;
+  return true;
+}
+
+bool dropout(uint16_t step) {
+  emu_link_ic = EMU_ICS / 2;
+  return true;
+}
+
+bool pec_storm(uint16_t step) {
+  for (int ic = 0; ic < EMU_ICS; ic++) {
+    emu[ic].pec_rate = 1000;
+  }
+  return true;
+}
+
+bool adc_stuck(uint16_t step) {
+  emu_adc_stuck = true;
+  return true;
+}
+
+const scenario SCENARIOS[] = {
+    {"ov", ov, 1000},                // next conversion
+    {"uv", uv, 1000},
+    {"ntc_open", ntc_open, 1000},    // error_temp(), temp <= temp_min
+    {"open_wire", open_wire, 1000},  // a cell reads 0, the next one double
+    {"dropout", dropout, 4000},      // STALE_LIMIT cycles of PEC errors
+    {"pec_storm", pec_storm, 4000},
+    {"adc_stuck", adc_stuck, 4000},  // PLADC timeout, stale as well
+};
+
+void restore() {
+  for (int ic = 0; ic < EMU_ICS; ic++) {
+    emu_ic *e = &emu[ic];
+    memset(e->cell_bias, 0, sizeof(e->cell_bias));
+    e->open_wire = 0;
+    e->ntc_open = 0;
+    e->pec_rate = 0;
+  }
+  emu_link_ic = EMU_ICS;
+  emu_adc_stuck = false;
+}
+
+bool settle() {
+  // A healthy, OK pack: the pin HIGH for SETTLE_CYCLES in a row
+  uint16_t healthy = 0;
+  for (uint32_t i = 0; i < MAX_CYCLES && healthy < SETTLE_CYCLES; i++) {
+    if (state == ST_FAULT_LATCHED) {
+      host_console("clear");
+    }
+    host_loops(1);
+    healthy = host_pin(FAULT_PIN) == HIGH ? healthy + 1 : 0;
+  }
+  return healthy == SETTLE_CYCLES;
+}
+
+bool run(const scenario *sc) {
+  if (!settle()) {
+    printf("inject %s: FAIL, no healthy pack to start from\n", sc->name);
+    return false;
+  }
+  bool present = false;
+  uint32_t fault_ms = 0;
+  bool tripped = false;
+  uint32_t now = millis();
+  for (uint16_t step = 0; step < MAX_CYCLES; step++) {
+    now = millis();
+    if (sc->apply(step) && !present) {
+      present = true;
+      fault_ms = now;
+    }
+    host_loops(1);
+    tripped = host_pin(FAULT_PIN) == LOW;
+    if (tripped || (present && millis() - fault_ms > sc->budget_ms)) {
+      break;
+    }
+  }
+  restore();
+  // A ramp may trip on the ADC noise a cycle before its input crosses
+  uint32_t latency = !present ? 0
+                     : tripped ? host_pin_ms(FAULT_PIN) - fault_ms
+                               : millis() - fault_ms;
+  bool pass = tripped && latency <= sc->budget_ms;
+  printf("inject %s: %s%s%u ms, budget %u ms\n", sc->name,
+         pass ? "PASS " : "FAIL ", tripped ? "" : "no trip after ", latency,
+         sc->budget_ms);
+  return pass;
+}
+
+}  // namespace
+
+int main() {
+  host_setup();
+  host_loops(2);
+  int passed = 0;
+  const int N = sizeof(SCENARIOS) / sizeof(SCENARIOS[0]);
+  for (int i = 0; i < N; i++) {
+    bool pass = run(&SCENARIOS[i]);
+    HOST_CHECK(pass);
+    passed += pass;
+  }
+  printf("Injection done, %d of %d passed\n", passed, N);
+  return host_report("inject");
+}
@@ -0,0 +1,222 @@
+// The register parsers under AddressSanitizer and UBSan. First properties
+// that must hold for any input, on random frames: pec15_calc() catches every
+// single bit error and every burst up to 15 bits, parse_cells() decodes a
+// good frame into exactly its three codes and flags a bad one, and
+// LTC6811_rdstat() does the same for both status groups, its frames answered
+// from a trace. Then the chain corrupts the bytes and commands of every read
+// (rdcv, rdaux, rdstat, rdcfg, all through read_68()) for a while. Any out of
+// bounds access aborts the test.
+#include "LTC6811.h"
+#include "LTC681x.h"
+#include "host.h"
+#include "trace.h"
+
+namespace {
+
+const int TOTAL_IC = 10;  // as in the sketch
+const int CELLS_PER_IC = 12;
+const uint32_t ROUNDS = 20000;
+const uint32_t STAT_BATCH = 300;  // rounds whose frames fit in the trace
+const uint16_t CANARY = 0xA5C3;
+
+uint32_t seed = 1;
+
+uint32_t rnd() {  // xorshift, the same run every time
+  seed ^= seed << 13;
+  seed ^= seed >> 17;
+  seed ^= seed << 5;
+  return seed;
+}
+
+// 6 random bytes and their PEC, broken in a bit the PEC really carries
+void random_frame(uint8_t *frame, bool good) {
+  for (int i = 0; i < 6; i++) {
+    frame[i] = rnd();
+  }
+  uint16_t pec = pec15_calc(6, frame);
+  if (!good) {
+    pec ^= 1 << (1 + rnd() % 15);
+  }
+  frame[6] = pec >> 8;
+  frame[7] = pec;
+}
+
+uint32_t check_pec(uint32_t rounds) {
+  // In any frame length the chain can send
+  uint32_t failures = 0;
+  uint8_t data[2 + NUM_RX_BYT * TOTAL_IC];
+  for (uint32_t r = 0; r < rounds; r++) {
+    uint8_t len = 1 + rnd() % (sizeof(data) - 2);
+    for (int i = 0; i < len; i++) {
+      data[i] = rnd();
+    }
+    uint16_t pec = pec15_calc(len, data);
+    failures += (pec & 1) != 0;  // the LSB of the PEC is always 0
+    uint16_t bit = rnd() % (8 * len);
+    uint8_t burst = 1 + rnd() % 15;  // first and last bit flipped
+    uint32_t pattern =
+        1 | (1UL << (burst - 1)) | (rnd() & ((1UL << burst) - 1));
+    for (int b = 0; b < burst && bit + b < 8 * len; b++) {
+      if (pattern & (1UL << b)) {
+        data[(bit + b) / 8] ^= 0x80 >> ((bit + b) % 8);
+      }
+    }
+    failures += pec15_calc(len, data) == pec;
+  }
+  return failures;
+}
+
+uint32_t check_cells(uint32_t rounds) {
+  // Random chains, every IC's frame good or bad at random. Nothing may be
+  // written outside the codes of the register being parsed.
+  uint32_t failures = 0;
+  uint8_t data[NUM_RX_BYT * TOTAL_IC];
+  uint16_t codes[1 + CELLS_PER_IC + 1];
+  uint8_t pec[1 + 6 + 1];
+  for (uint32_t r = 0; r < rounds; r++) {
+    uint8_t n = 1 + rnd() % TOTAL_IC;
+    uint8_t reg = 1 + rnd() % 4;
+    uint16_t good = rnd();
+    for (int ic = 0; ic < n; ic++) {
+      random_frame(&data[ic * NUM_RX_BYT], good & (1 << ic));
+    }
+    for (int ic = 0; ic < n; ic++) {
+      for (int i = 0; i < CELLS_PER_IC + 2; i++) {
+        codes[i] = CANARY;
+      }
+      memset(pec, 0xA5, sizeof(pec));
+      bool ok = good & (1 << ic);
+      int8_t error = parse_cells(ic, reg, data, &codes[1], &pec[1]);
+      bool fail = error != !ok || pec[reg] != !ok;
+      for (int i = 0; i < CELLS_PER_IC + 2; i++) {
+        int k = i - 1 - (reg - 1) * 3;  // code within this register
+        uint8_t *src = &data[ic * NUM_RX_BYT + 2 * constrain(k, 0, 2)];
+        fail |= (k >= 0 && k < 3) ? codes[i] != (src[0] | (src[1] << 8))
+                                  : codes[i] != CANARY;
+      }
+      for (int i = 0; i < (int)sizeof(pec); i++) {
+        fail |= i != reg && pec[i] != 0xA5;
+      }
+      failures += fail;
+    }
+  }
+  return failures;
+}
+
+void put_cmd(uint8_t *cmd, uint16_t code) {
+  cmd[0] = code >> 8;
+  cmd[1] = code;
+  uint16_t pec = pec15_calc(2, cmd);
+  cmd[2] = pec >> 8;
+  cmd[3] = pec;
+}
+
+uint32_t check_stat(uint32_t rounds) {
+  // Status groups A and B of the whole chain, recorded as a trace and read
+  // back through LTC6811_rdstat(). Only the status and the PEC counters of each
+  // IC may change.
+  const char *FILE_NAME = "parsers_stat.bin";
+  uint32_t failures = 0;
+  static uint8_t frames[STAT_BATCH][2][NUM_RX_BYT * TOTAL_IC];
+  static uint16_t good[STAT_BATCH][2];
+  cell_asic ics[1 + TOTAL_IC + 1];
+  cell_asic before[1 + TOTAL_IC + 1];
+  for (uint32_t done = 0; done < rounds; done += STAT_BATCH) {
+    uint32_t n = min(rounds - done, STAT_BATCH);
+    trace_start(false);
+    for (uint32_t r = 0; r < n; r++) {
+      for (int g = 0; g < 2; g++) {
+        uint8_t cmd[4];
+        put_cmd(cmd, g == 0 ? 0x0010 : 0x0012);  // RDSTATA, RDSTATB
+        good[r][g] = rnd();
+        for (int ic = 0; ic < TOTAL_IC; ic++) {
+          random_frame(&frames[r][g][ic * NUM_RX_BYT], good[r][g] & (1 << ic));
+        }
+        trace_record(0, cmd, 4, frames[r][g], sizeof(frames[r][g]));
+      }
+    }
+    trace_save(FILE_NAME);
+    trace_stop();
+    trace_play(FILE_NAME);
+    for (uint32_t r = 0; r < n; r++) {
+      memset(ics, 0xA5, sizeof(ics));
+      for (int ic = 0; ic < TOTAL_IC + 2; ic++) {
+        ics[ic].isospi_reverse = false;
+      }
+      LTC6811_init_reg_limits(TOTAL_IC, &ics[1]);  // register counts it uses
+      memcpy(before, ics, sizeof(ics));
+      bool all_good = (good[r][0] & good[r][1] & 0x3FF) == 0x3FF;
+      int8_t error = LTC6811_rdstat(0, TOTAL_IC, &ics[1]);
+      bool fail = error != (all_good ? 0 : -1);
+      fail |= memcmp(&ics[0], &before[0], sizeof(ics[0])) != 0;
+      fail |= memcmp(&ics[TOTAL_IC + 1], &before[TOTAL_IC + 1],
+                     sizeof(ics[0])) != 0;
+      for (int ic = 0; ic < TOTAL_IC; ic++) {
+        st *stat = &ics[1 + ic].stat;
+        const uint8_t *a = &frames[r][0][ic * NUM_RX_BYT];
+        const uint8_t *b = &frames[r][1][ic * NUM_RX_BYT];
+        for (int g = 0; g < 2; g++) {
+          fail |= stat->pec_match[g] != !(good[r][g] & (1 << ic));
+        }
+        if (good[r][0] & (1 << ic)) {
+          for (int i = 0; i < 3; i++) {
+            fail |= stat->stat_codes[i] != (a[2 * i] | (a[2 * i + 1] << 8));
+          }
+        }
+        if (good[r][1] & (1 << ic)) {
+          fail |= stat->stat_codes[3] != (b[0] | (b[1] << 8));
+          fail |= memcmp(stat->flags, &b[2], 3) != 0;
+          fail |= stat->mux_fail[0] != ((b[5] >> 1) & 0x01);
+          fail |= stat->thsd[0] != (b[5] & 0x01);
+        }
+        // The PEC counters go up by the bad frames, everything else of the
+        // IC but its status is left alone
+        pec_counter *count = &ics[1 + ic].crc_count;
+        const pec_counter *was = &before[1 + ic].crc_count;
+        int bad = 0;
+        for (int g = 0; g < 2; g++) {
+          bool bad_g = !(good[r][g] & (1 << ic));
+          fail |= count->stat_pec[g] != (uint16_t)(was->stat_pec[g] + bad_g);
+          bad += bad_g;
+        }
+        fail |= count->pec_count != (uint16_t)(was->pec_count + bad);
+        cell_asic kept = before[1 + ic];
+        before[1 + ic].stat = *stat;
+        before[1 + ic].crc_count = *count;
+        fail |= memcmp(&ics[1 + ic], &before[1 + ic], sizeof(ics[0])) != 0;
+        before[1 + ic] = kept;
+      }
+      failures += fail;
+    }
+    trace_stop();
+  }
+  remove(FILE_NAME);
+  return failures;
+}
+
+}  // namespace
+
+int main() {
+  uint32_t pec = check_pec(ROUNDS);
+  uint32_t cells = check_cells(ROUNDS);
+  uint32_t stat = check_stat(ROUNDS / 10);
+  printf("pec15: %u, parse_cells: %u, rdstat: %u failures\n", pec, cells,
+         stat);
+  HOST_CHECK(pec == 0);
+  HOST_CHECK(cells == 0);
+  HOST_CHECK(stat == 0);
+
+  host_setup();
+  host_loops(2);
+  host_command("emu pec all 300");
+  host_command("emu cmd 100");
+  host_loops(40);
+  HOST_CHECK(host_printed("A PEC error was detected"));
+  host_command("emu pec all 0");
+  host_command("emu cmd 0");
+  host_loops(1);
+  host_clear_output();
+  host_loops(4);
+  HOST_CHECK(!host_printed("PEC"));
+  return host_report("parsers");
+}
@@ -0,0 +1,82 @@
+// BALANCE_ONLY through the PWM register: each plan goes out once, then the
+// chain is left alone until the LTC6811 watchdog expires, and from there on
+// every S pin is on for the duty plan_balance() gave its cell.
+#include <string>
+
+#include "emulator.h"
+#include "host.h"
+
+extern uint8_t pwm_duty[][12];
+
+namespace {
+
+const int TOTAL_IC = 10;  // as in the sketch
+
+// The number in front of `unit` in the last line that has it
+double printed(const char *unit) {
+  const std::string &out = host_output();
+  size_t at = out.rfind(unit);
+  if (at == std::string::npos) {
+    return -1;
+  }
+  size_t start = out.find_last_of(" ,", at - 2) + 1;
+  return atof(out.c_str() + start);
+}
+
+// The number after `label` in the last line that has it
+double count(const char *label) {
+  const std::string &out = host_output();
+  size_t at = out.rfind(label);
+  return at == std::string::npos ? -1 : atof(out.c_str() + at + strlen(label));
+}
+
+// S pins against the plan, on every IC
+bool pins_follow(bool duty) {
+  int bleeding = 0;
+  for (int ic = 0; ic < TOTAL_IC; ic++) {
+    for (int i = 0; i < 12; i++) {
+      float want = duty ? pwm_duty[ic][i] / 15.0 : 0;
+      if (fabs(emu_s_duty(ic, i, emu_us()) - want) > 1e-6) {
+        return false;
+      }
+      bleeding += pwm_duty[ic][i] > 0;
+    }
+  }
+  return !duty || bleeding > 0;
+}
+
+}  // namespace
+
+int main() {
+  host_setup();
+  host_loops(2);
+  host_console("mode idle");
+  host_loops(1);
+  host_console("mode balance");
+  HOST_CHECK(host_loops_until("IDLE -> BALANCE_ONLY", 3));
+
+  // 3 s into a window the watchdog has expired and the PWM drives the pins
+  host_command("emu stats");
+  host_loops(1);
+  double resets = count("watchdog resets ");
+  host_console("dump duty");
+  host_loops(12);
+  HOST_CHECK(pins_follow(true));
+
+  // One wrcfg to restore CFGR and at most one per plan, every 5 s
+  host_loops(400);
+  host_clear_output();
+  host_console("dump duty");
+  host_command("emu stats");
+  host_loops(1);
+  printf("%s", host_output().c_str());
+  HOST_CHECK(printed(" wrcfg/s") > 0 && printed(" wrcfg/s") < 0.5);
+  HOST_CHECK(printed(" cell-s/s") > 0);
+  HOST_CHECK(count("watchdog resets ") >= resets + 3);
+
+  // A request ends the window at once, and leaving stops the bleeding
+  host_console("mode idle");
+  HOST_CHECK(host_loops_until("BALANCE_ONLY -> IDLE", 2));
+  HOST_CHECK(pins_follow(false));
+  return host_report("pwm_balance");
+}
@@ -0,0 +1,50 @@
+// Record cycles of the simulated pack to the SD log, then replay the log
+// twice: both runs must take every frame and reach the same decisions.
+#include <SD.h>
+
+#include <string>
+
+#include "host.h"
+
+namespace {
+
+// The digest printed at the end of the last replay
+std::string digest() {
+  const std::string &out = host_output();
+  size_t at = out.rfind("digest ");
+  return at == std::string::npos ? "" : out.substr(at + 7, 8);
+}
+
+}  // namespace
+
+int main() {
+  const char *FILE_NAME = "replay_test.bin";
+  const uint32_t FRAMES = 300;
+  remove(FILE_NAME);
+  host_setup();
+  host_command("sim soc 60");
+  host_command("sim race 1");
+  host_loops(2);
+
+  host_console("log start replay_test.bin");
+  host_loops(FRAMES);
+  host_console("log stop");
+  host_loops(1);
+  HOST_CHECK(host_printed("Log closed"));
+
+  std::string first;
+  for (int run = 0; run < 2; run++) {
+    host_clear_output();
+    HOST_CHECK(host_command("replay replay_test.bin"));
+    HOST_CHECK(host_printed("Replayed 300 frames"));
+    HOST_CHECK(!host_printed("Bad log frame"));
+    printf("%s", host_output().c_str() + host_output().rfind("Replayed"));
+    if (run == 0) {
+      first = digest();
+    }
+  }
+  HOST_CHECK(!first.empty());
+  HOST_CHECK(digest() == first);
+  remove(FILE_NAME);
+  return host_report("replay");
+}
@@ -0,0 +1,79 @@
+// The BMS state machine through its inputs: requests from the console and
+// BMS_Command, a latching manual fault, stale data that clears by itself,
+// and BMS_FAULT_PIN in every state.
+#include "host.h"
+#include "sim.h"
+
+namespace {
+
+const uint32_t FAULT_PIN = 2;       // BMS_FAULT_PIN
+const uint32_t ID_COMMAND = 0x610;  // CAN_ID_COMMAND
+
+void command(uint8_t request, bool clear) {
+  host_can_frame frame = {ID_COMMAND, false, 2, {request, clear}};
+  host_can_send(frame);
+}
+
+// The transition is printed within max cycles, with the pin at level
+bool goes(const char *transition, int level, uint32_t max) {
+  bool printed = host_loops_until(transition, max);
+  host_clear_output();
+  return printed && host_pin(FAULT_PIN) == level;
+}
+
+}  // namespace
+
+int main() {
+  sim_init(0.5, 0.02);
+  host_setup();
+  HOST_CHECK(goes("INIT -> IDLE", HIGH, 2));
+  HOST_CHECK(goes("IDLE -> DRIVE", HIGH, 2));
+
+  host_console("mode balance");
+  HOST_CHECK(goes("DRIVE -> IDLE", HIGH, 2));
+  HOST_CHECK(goes("IDLE -> BALANCE_ONLY", HIGH, 2));
+  // CHARGE needs the request and a charger on the bus
+  host_console("mode charge");
+  HOST_CHECK(goes("BALANCE_ONLY -> IDLE", HIGH, 2));
+  host_loops(3);
+  HOST_CHECK(!host_printed("->"));
+  host_command("sim charger on");
+  HOST_CHECK(goes("IDLE -> CHARGE", HIGH, 2));
+  command(1, false);  // REQ_DRIVE over CAN
+  HOST_CHECK(goes("CHARGE -> IDLE", HIGH, 2));
+  HOST_CHECK(goes("IDLE -> DRIVE", HIGH, 2));
+  command(0xFF, false);  // keeps the request
+  host_loops(3);
+  HOST_CHECK(!host_printed("->"));
+
+  // A manual fault latches until it is cleared
+  host_console("fault");
+  HOST_CHECK(goes("DRIVE -> FAULT_LATCHED", LOW, 2));
+  host_loops(30);
+  HOST_CHECK(!host_printed("->") && host_pin(FAULT_PIN) == LOW);
+  host_console("clear");
+  HOST_CHECK(goes("FAULT_LATCHED -> IDLE", HIGH, 2));
+  HOST_CHECK(goes("IDLE -> DRIVE", HIGH, 2));
+
+  // Stale data is recoverable, it ends after FAULT_RECOVER_CYCLES clean ones
+  host_command("emu pec 2 1000");
+  HOST_CHECK(goes("DRIVE -> FAULT_RECOVERABLE", LOW, 12));
+  host_command("emu pec 2 0");
+  HOST_CHECK(goes("FAULT_RECOVERABLE -> IDLE", HIGH, 25));
+  HOST_CHECK(goes("IDLE -> DRIVE", HIGH, 2));
+
+  // A latching fault while recovering latches. BMS_Command doesn't clear
+  // a manual fault, that is still there, the console does
+  host_command("emu pec 2 1000");
+  HOST_CHECK(goes("DRIVE -> FAULT_RECOVERABLE", LOW, 12));
+  host_command("emu pec 2 0");
+  host_console("fault");
+  HOST_CHECK(goes("FAULT_RECOVERABLE -> FAULT_LATCHED", LOW, 2));
+  command(0xFF, true);
+  host_loops(3);
+  HOST_CHECK(!host_printed("->") && host_pin(FAULT_PIN) == LOW);
+  host_console("clear");
+  HOST_CHECK(goes("FAULT_LATCHED -> IDLE", HIGH, 2));
+  HOST_CHECK(goes("IDLE -> DRIVE", HIGH, 2));
+  return host_report("state_machine");
+}
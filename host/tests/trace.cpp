@@ -0,0 +1,38 @@
+// SPI trace at the bms_hardware.cpp boundary: record a few healthy cycles,
+// then play them back over a chain whose every frame fails PEC. The
+// recorded frames must answer the sketch until the trace runs out.
+#include "host.h"
+#include "trace.h"
+
+int main() {
+  const char *FILE_NAME = "trace_test.bin";
+  remove(FILE_NAME);
+  host_setup();
+  host_loops(2);
+
+  trace_start(false);
+  host_loops(6);
+  HOST_CHECK(trace_save(FILE_NAME));
+  trace_stop();
+  HOST_CHECK(host_printed("bytes of trace saved"));
+
+  host_command("emu pec all 1000");
+  host_loops(1);
+  HOST_CHECK(trace_play(FILE_NAME));
+  host_clear_output();
+  host_loops(4);
+  HOST_CHECK(!host_printed("Trace played"));
+  HOST_CHECK(!host_printed("PEC"));
+  HOST_CHECK(host_loops_until("Trace played", 10));
+  HOST_CHECK(host_loops_until("Stale data", 20));  // emu[] answers again
+
+  // A trigger keeps what led up to the first PEC error
+  host_command("emu pec all 0");
+  host_console("clear");
+  host_loops(2);
+  trace_start(true);
+  host_command("emu pec 3 500");
+  HOST_CHECK(host_loops_until("Trace triggered on a PEC error", 10));
+  remove(FILE_NAME);
+  return host_report("trace");
+}
@@ -0,0 +1,35 @@
+// A watchdog reset must not clear a latched fault: with one recorded in
+// GPBR[1] the board boots into FAULT_LATCHED with BMS_FAULT_PIN LOW, and
+// only the operator clears it.
+#include "host.h"
+
+namespace {
+
+const uint32_t FAULT_PIN = 2;       // BMS_FAULT_PIN
+const uint32_t MAGIC = 0x57440000;  // RESET_MAGIC
+const uint32_t WATCHDOG = 2;        // RSTC_SR RSTTYP
+
+}  // namespace
+
+int main() {
+  host_rstc.RSTC_SR = WATCHDOG << RSTC_SR_RSTTYP_Pos;
+  host_gpbr.SYS_GPBR[1] = MAGIC | 6;  // loop overrun when the reset hit
+  host_setup();
+  HOST_CHECK(host_printed("Reset: watchdog, fault 6 still latched"));
+  host_loops(10);
+  HOST_CHECK(host_pin(FAULT_PIN) == LOW);
+  HOST_CHECK(!host_printed("-> IDLE"));
+  HOST_CHECK(host_gpbr.SYS_GPBR[1] == (MAGIC | 6));
+
+  host_console("clear");
+  HOST_CHECK(host_loops_until("FAULT_LATCHED -> IDLE", 5));
+  HOST_CHECK(host_loops_until("IDLE -> DRIVE", 5));
+  HOST_CHECK(host_pin(FAULT_PIN) == HIGH);
+  HOST_CHECK(host_gpbr.SYS_GPBR[1] == 0);
+
+  // A fault that latches now is recorded for the next reset
+  host_console("fault");
+  HOST_CHECK(host_loops_until("-> FAULT_LATCHED", 5));
+  HOST_CHECK(host_gpbr.SYS_GPBR[1] == (MAGIC | 4));
+  return host_report("watchdog_reset");
+}
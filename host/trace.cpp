@@ -0,0 +1,164 @@
+// SPI trace, see trace.h. A transaction is kept as a trace_head followed by
+// the bytes sent and the bytes received, the same in the ring and the file.
+#include "trace.h"
+
+#include "LTC681x.h"
+#include "host.h"
+
+namespace {
+
+const size_t TRACE_BYTES = 65536;  // ring size, oldest transactions dropped
+const int TRACE_POST = 24;         // transactions kept after the trigger
+
+enum trace_mode {
+  TRACE_OFF,
+  TRACE_RUN,     // keep the latest TRACE_BYTES
+  TRACE_ARMED,   // as RUN, freezes TRACE_POST transactions after a PEC error
+  TRACE_FROZEN,  // triggered, ring left as it is for saving
+};
+
+typedef struct {
+  uint32_t us;  // micros() at CS low
+  uint16_t tx_len;
+  uint16_t rx_len;
+  uint8_t pec_errors;  // ICs whose received frame failed PEC
+  uint8_t reserved[3];
+} trace_head;
+
+std::deque<std::vector<uint8_t> > ring;
+size_t ring_bytes = 0;
+int mode = TRACE_OFF;
+int left = 0;  // transactions still kept after the trigger
+FILE *playing = NULL;
+uint32_t played = 0;
+uint32_t skipped = 0;  // trace entries with no matching command
+
+void stop_play() {
+  fclose(playing);
+  playing = NULL;
+  host_printf("Trace played, %u transactions answered, %u skipped\n",
+              played, skipped);
+}
+
+}  // namespace
+
+void trace_start(bool trigger) {
+  ring.clear();
+  ring_bytes = 0;
+  left = TRACE_POST;
+  mode = trigger ? TRACE_ARMED : TRACE_RUN;
+}
+
+void trace_stop() {
+  mode = TRACE_OFF;
+  if (playing) {
+    stop_play();
+  }
+}
+
+bool trace_save(const char *path) {
+  FILE *f = fopen(path, "wb");
+  if (!f) {
+    return false;
+  }
+  for (size_t i = 0; i < ring.size(); i++) {
+    fwrite(ring[i].data(), 1, ring[i].size(), f);
+  }
+  fclose(f);
+  host_printf("%u bytes of trace saved\n", (unsigned)ring_bytes);
+  return true;
+}
+
+bool trace_play(const char *path) {
+  if (playing || !(playing = fopen(path, "rb"))) {
+    return false;
+  }
+  mode = TRACE_OFF;  // don't trace the playback into itself
+  played = 0;
+  skipped = 0;
+  return true;
+}
+
+void trace_record(uint32_t us, const uint8_t *tx, uint16_t tx_len,
+                  const uint8_t *rx, uint16_t rx_len) {
+  if (mode == TRACE_OFF || mode == TRACE_FROZEN) {
+    return;
+  }
+  trace_head h = {us, tx_len, rx_len, 0, {0}};
+  for (uint16_t k = 0; k + NUM_RX_BYT <= rx_len; k += NUM_RX_BYT) {
+    h.pec_errors +=
+        pec15_calc(6, (uint8_t *)&rx[k]) != ((rx[k + 6] << 8) | rx[k + 7]);
+  }
+  std::vector<uint8_t> entry((const uint8_t *)&h, (const uint8_t *)(&h + 1));
+  entry.insert(entry.end(), tx, tx + tx_len);
+  entry.insert(entry.end(), rx, rx + rx_len);
+  while (!ring.empty() && ring_bytes + entry.size() > TRACE_BYTES) {
+    ring_bytes -= ring.front().size();
+    ring.pop_front();
+  }
+  ring_bytes += entry.size();
+  ring.push_back(entry);
+
+  if (mode == TRACE_ARMED && left < TRACE_POST) {
+    left--;  // counting down since the trigger
+  } else if (mode == TRACE_ARMED && h.pec_errors > 0) {
+    left--;
+    host_printf("Trace triggered on a PEC error\n");
+  }
+  if (left == 0) {
+    mode = TRACE_FROZEN;
+  }
+}
+
+bool trace_answer(const uint8_t *tx, uint8_t *rx, uint16_t rx_len) {
+  // Anything recorded in between (a retry the new code doesn't make) is
+  // skipped
+  if (!playing) {
+    return false;
+  }
+  trace_head h;
+  std::vector<uint8_t> data;
+  while (fread(&h, sizeof(h), 1, playing) == 1) {
+    data.resize(h.tx_len + h.rx_len);
+    if (h.tx_len < 4 || fread(data.data(), 1, data.size(), playing) !=
+                            data.size()) {
+      break;
+    }
+    if (memcmp(data.data(), tx, 4) != 0) {
+      skipped++;
+      continue;
+    }
+    if (rx_len) {
+      memset(rx, 0xFF, rx_len);
+      memcpy(rx, &data[h.tx_len], min(rx_len, h.rx_len));
+    }
+    played++;
+    return true;
+  }
+  stop_play();
+  return false;
+}
+
+void trace_command(int argc, char **argv) {
+  const char *what = argc >= 2 ? argv[1] : "";
+  if (strcmp(what, "on") == 0 || strcmp(what, "trigger") == 0) {
+    trace_start(what[0] == 't');
+  } else if (strcmp(what, "off") == 0) {
+    trace_stop();
+  } else if (strcmp(what, "save") == 0 && argc == 3) {
+    if (!trace_save(argv[2])) {
+      host_printf("Can't open the trace file\n");
+    }
+  } else if (strcmp(what, "play") == 0 && argc == 3) {
+    if (!trace_play(argv[2])) {
+      host_printf("Can't play the trace\n");
+    }
+  } else {
+    host_printf("Trace %s, %u bytes\n",
+                mode == TRACE_OFF      ? "off"
+                : mode == TRACE_FROZEN ? "triggered"
+                                       : "running",
+                (unsigned)ring_bytes);
+    host_printf("trace on|trigger|off|save <file>|play <file>\n");
+  }
+}
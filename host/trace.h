@@ -0,0 +1,25 @@
+// SPI trace of the host build. host/bms_hardware.cpp hands every CS framed
+// transaction to trace_record() once it is on the wire, and asks
+// trace_answer() first while a trace is played back.
+#ifndef HOST_TRACE_H
+#define HOST_TRACE_H
+
+#include <stdint.h>
+
+// Keeps the latest transactions, with trigger the ring freezes a few
+// transactions after the first one with a PEC error
+void trace_start(bool trigger);
+void trace_stop();  // recording and playback
+bool trace_save(const char *path);  // oldest first, false if not written
+bool trace_play(const char *path);  // answer from the file, see below
+
+void trace_record(uint32_t us, const uint8_t *tx, uint16_t tx_len,
+                  const uint8_t *rx, uint16_t rx_len);
+// The next recorded transaction with the same command answers this one.
+// False when no trace plays or it has run out.
+bool trace_answer(const uint8_t *tx, uint8_t *rx, uint16_t rx_len);
+
+// `trace on|trigger|off|save <file>|play <file>`, see host_command()
+void trace_command(int argc, char **argv);
+
+#endif  // HOST_TRACE_H